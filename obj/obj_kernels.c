@@ -0,0 +1,48 @@
+// Built once per instruction set, the loader picks one through bin/kernels.manifest
+
+const char *variant(void) {
+#if defined(__AVX512F__)
+    return "avx512f";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE4_2__)
+    return "sse4.2";
+#else
+    return "default";
+#endif
+}
+
+// Vectorized with whatever the variant was built for
+void scale(float *v, float factor, int n) {
+    for(int i = 0; i < n; i++) {
+        v[i] *= factor;
+    }
+}
+
+// Dispatched through an IFUNC resolver instead, in every variant
+__attribute__((target_clones("avx2", "default")))
+int sum(const int *v, int n) {
+    int total = 0;
+    for(int i = 0; i < n; i++) {
+        total += v[i];
+    }
+    return total;
+}
+
+// Function pointer to an IFUNC symbol, relocated once the resolver has run
+int (*sum_ptr)(const int *, int) = sum;
+
+int call_sum(const int *v, int n) {
+    return sum_ptr(v, n);
+}
+
+int sum_twice(const int *v, int n) {
+    return sum(v, n) + sum(v, n);
+}
+
+// Chunk kernel for parallel_map in the loader
+void square(const float *in, float *out, unsigned long n) {
+    for(unsigned long i = 0; i < n; i++) {
+        out[i] = in[i] * in[i];
+    }
+}
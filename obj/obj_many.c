@@ -0,0 +1,17 @@
+// 1024 functions, each with a kilobyte of never executed code, to benchmark code layout.
+// Built with -ffunction-sections, so that every function can be placed on its own.
+#define FUNC(n) \
+    int func##n(int num) { \
+        if(__builtin_expect(num < 0, 0)) { \
+            __asm__ volatile(".skip 1024, 0x90"); \
+        } \
+        return num + 1; \
+    }
+
+#define FUNC4(n) FUNC(n##0) FUNC(n##1) FUNC(n##2) FUNC(n##3)
+#define FUNC16(n) FUNC4(n##0) FUNC4(n##1) FUNC4(n##2) FUNC4(n##3)
+#define FUNC64(n) FUNC16(n##0) FUNC16(n##1) FUNC16(n##2) FUNC16(n##3)
+#define FUNC256(n) FUNC64(n##0) FUNC64(n##1) FUNC64(n##2) FUNC64(n##3)
+#define FUNC1024(n) FUNC256(n##0) FUNC256(n##1) FUNC256(n##2) FUNC256(n##3)
+
+FUNC1024(_)
@@ -0,0 +1,34 @@
+// Per-thread state, built with each TLS model the loader supports: global dynamic (-fPIC), initial exec
+// and local exec. The last two need zero initialized thread locals, see register_tls_module.
+
+static __thread unsigned long calls;
+__thread unsigned long total;
+
+#ifdef STATIC_TLS
+static const unsigned long start = 1000;
+#else
+static __thread unsigned long start = 1000;
+#endif
+
+unsigned long count(unsigned long n) {
+    calls++;
+    total += n;
+    return start + total;
+}
+
+unsigned long get_calls(void) {
+    return calls;
+}
+
+unsigned long *total_addr(void) {
+    return &total;
+}
+
+// Keeps the compiler from folding start, so that the global dynamic build reads .tdata
+void set_start(unsigned long n) {
+#ifndef STATIC_TLS
+    start = n;
+#else
+    (void)n;
+#endif
+}
@@ -0,0 +1,5588 @@
+// For statx, MAP_POPULATE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// For open, fstat
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// For mmap
+#include <sys/mman.h>
+
+// For sysconf
+#include <unistd.h>
+
+// For parsing ELF files
+#include <elf.h>
+
+// For bulk loading through io_uring
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// For benchmarks
+#include <time.h>
+#include <linux/perf_event.h>
+
+// For the symbol registry
+#include <pthread.h>
+#include <sched.h>
+
+// For running the compiler
+#include <sys/wait.h>
+
+// For counting the threads before static TLS is reused
+#include <dirent.h>
+
+#include <error.h>
+#include <errno.h>
+
+// USDT probes for the load phases, see trace_start. They are nops until a tracer attaches, so they
+// stay compiled in whenever systemtap's header is around.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LOADER_PROBE_START(phase, object, detail) STAP_PROBE3(loader, phase_start, phase, object, detail)
+#define LOADER_PROBE_DONE(phase, object, detail, bytes, count) STAP_PROBE5(loader, phase_done, phase, object, detail, bytes, count)
+#endif
+#endif
+
+#ifndef LOADER_PROBE_START
+#define LOADER_PROBE_START(phase, object, detail)
+#define LOADER_PROBE_DONE(phase, object, detail, bytes, count)
+#endif
+
+// Page size to align memory
+static uint64_t page_size;
+
+// Trampoline function
+typedef struct {
+    uint8_t data[15];
+    uint8_t *startaddr;
+} Trampoline;
+
+// Jumptable entry 
+struct ext_jump {
+    uint8_t *addr;
+    uint8_t instr[6];
+};
+
+// Loaded sections are grouped by the permissions they need at runtime, so that every group
+// takes a single mprotect call and ends up as a single VMA
+enum section_class {
+    SECTION_SKIP,
+    SECTION_EXEC,   // .text*, trampolines and jumptable, RX
+    SECTION_RODATA, // .rodata*, R
+    SECTION_DATA,   // .data*, .bss*, RW
+    NUM_SECTION_CLASSES
+};
+
+// Where the object file image came from, which decides how it is released
+enum object_source {
+    SOURCE_BORROWED, // caller owned buffer passed to load_obj_mem
+    SOURCE_MAPPED,   // file mapped by the loader
+    SOURCE_MALLOCED, // pipe or socket read into memory by the loader
+    SOURCE_ARENA,    // slice of an arena shared by the objects of one load_objs call
+};
+
+// Phases of a load, timed by trace_start and trace_done
+enum load_phase {
+    PHASE_LOAD_OBJ,
+    PHASE_LOAD_OBJS_URING,
+    PHASE_SECTIONS,
+    PHASE_STRIP,
+    PHASE_COUNT_RELOCS,
+    PHASE_RELOCATE,
+    PHASE_RESOLVE_EXT,
+    PHASE_MPROTECT,
+    NUM_LOAD_PHASES
+};
+
+// Arena holding the images of several objects, unmapped with the last of them
+struct object_arena {
+    uint8_t *base;
+    size_t size;
+    int refs; // atomic, objects may be unloaded from any thread
+};
+
+// Runtime region shared by the objects parsed together, unmapped with the last of them
+struct runtime_region {
+    uint8_t *base;
+    size_t size;
+
+    // Page aligned size of each group
+    size_t class_size[NUM_SECTION_CLASSES];
+
+    // Syscalls issued to set up the region
+    int num_syscalls;
+
+    // Bytes of each group holding sections, trampolines or jumptables, the rest is padding
+    size_t used_size[NUM_SECTION_CLASSES];
+
+    // Last get_process_stats call which counted the region, so that it is counted once
+    unsigned stats_epoch;
+
+    int refs; // atomic, objects may be unloaded from any thread
+};
+
+// Relocation against an IFUNC symbol, held back until the code can run the resolver
+struct ifunc_reloc {
+    int type;
+    int is_exec;
+    uint8_t *patch_offset;
+    uint8_t *resolver;
+    int64_t addend;
+};
+
+// A single loaded object
+struct object {
+    const char *name;
+
+    // Object file image, released as soon as the object is relocated
+    union {
+        const Elf64_Ehdr *hdr;
+        const uint8_t *base;
+    };
+    size_t size;
+    enum object_source source;
+    struct object_arena *arena;
+
+    Elf64_Half num_sections;
+
+    // Sections table
+    const Elf64_Shdr *sections;
+    const char *shstrtab;
+
+    // Symbols table
+    const Elf64_Sym *symbols;
+
+    // Number of entries in the symbols table
+    int num_symbols;
+    const char *strtab;
+
+    // Copy of the symbols and strings tables which outlives the object file image
+    void *symbols_copy;
+
+    // Runtime address of every section, NULL for the sections which are not loaded
+    uint8_t **section_runtime_bases;
+
+    // Runtime region holding the loaded sections
+    struct runtime_region *region;
+
+    Trampoline *trampoline_runtime_base;
+
+    // Number of absolute 32 bit relocation and the trampolines used so far
+    size_t num_absolute_relocs;
+    size_t num_trampolines;
+
+    // Number of external symbols in the symbol table and the jumptable entries used so far
+    int num_ext_symbols;
+    int num_jumps;
+
+    struct ext_jump *jumptable;
+
+    // Number of relocations against IFUNC symbols and the ones held back so far
+    int num_ifunc_relocs;
+    int num_deferred;
+
+    struct ifunc_reloc *deferred;
+
+    // Copies of the names published to the symbol registry, they outlive the object file image
+    char *registry_names;
+
+    // Entries the object published, kept to rebuild the registry when a newer object shadowing them is retired
+    struct registry_entry *registry_entries;
+    size_t num_registry_entries;
+
+    // Published objects, oldest first
+    struct object *prev_published;
+    struct object *next_published;
+
+    // Code shared by the instances created from this object, see instantiate_obj
+    struct shared_text *shared_text;
+
+    // Object whose writable data this one uses instead of its own, see share_data_sections
+    struct object *shared_data;
+
+    // Sections pointing into shared_data, their relocations were already applied by the owner
+    uint8_t *shared_sections;
+
+    // Call counting stubs and the optimized rebuild of this object, see compile_tiered
+    struct tiering *tiering;
+
+    // Thread local storage module of the object, 0 if it has no .tdata or .tbss, see tls_get_addr
+    size_t tls_module;
+
+    // Offset of every TLS section in the object's TLS block
+    size_t *tls_offsets;
+
+    // Relocations which need the TLS block at a fixed offset from the thread pointer, and that offset
+    int num_static_tls_relocs;
+    intptr_t tls_static_offset;
+
+    // Entry points to keep if set before parsing, everything they don't reach is left out, see strip_unreachable
+    const char **roots;
+    int num_roots;
+
+    // Sections reachable from the roots, NULL if all are loaded
+    uint8_t *live_sections;
+
+    // Bytes and relocations the roots saved
+    size_t stripped_bytes;
+    size_t stripped_relocs;
+
+    // Collected while loading, see get_obj_stats
+    struct {
+        size_t section_bytes[NUM_SECTION_CLASSES];
+        uint64_t relocs_by_type[R_X86_64_NUM];
+        uint64_t phase_ns[NUM_LOAD_PHASES];
+        int num_syscalls;
+
+        // Bytes of each group of the region the object uses, and those the objects placed before it use
+        size_t region_used[NUM_SECTION_CLASSES];
+        size_t region_used_before[NUM_SECTION_CLASSES];
+    } counters;
+
+    // Objects which are loaded and not unloaded yet, see get_process_stats
+    struct object *prev_loaded;
+    struct object *next_loaded;
+};
+
+// Every tiered function is called through a stub in the loader's own code:
+//
+//     incq calls(%rip)
+//     jmp *target(%rip)
+//
+// The target starts out as the baseline build and is swapped for the optimized one once the function
+// is hot. The count is not atomic, losing an increment under contention only delays promotion.
+#define TIER_STUB_SIZE 16
+
+struct tier_slot {
+    uint64_t calls;
+    uint8_t *target;
+};
+
+struct tiered_function {
+    const char *name;
+    int promoted;
+};
+
+struct tiering {
+    // Compiled again with optimizations once a function is hot
+    char *source;
+    char *flags;
+    uint64_t threshold;
+
+    // Stubs followed by their slots, in one mapping so that they can be addressed RIP relative
+    uint8_t *stubs;
+    struct tier_slot *slots;
+    size_t size;
+
+    struct tiered_function *functions;
+    int num_functions;
+    int num_promoted;
+
+    struct object *optimized;
+    int failed;
+
+    // Baseline object, and the next object watched by the tiering thread
+    struct object *obj;
+    struct tiering *next;
+};
+
+static int my_puts(const char *s) {
+    puts("my_puts executed");
+    return puts(s);
+}
+
+static inline uint64_t page_align(uint64_t n) {
+    return (n + (page_size - 1)) & ~(page_size - 1);
+}
+
+static inline uint64_t align_to(uint64_t n, uint64_t alignment) {
+    if(alignment <= 1) {
+        return n;
+    }
+
+    return (n + (alignment - 1)) & ~(alignment - 1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Event log written when LOADER_TRACE names a file, or "-" for stderr. Every phase of a load is one
+// JSON object per line with the object name, a detail such as the section or symbol, the bytes and
+// entries it handled and its duration.
+static FILE *trace_file = NULL;
+
+// Set by LOADER_STATS or the caller to add up the duration of every phase per object, see get_obj_stats
+static int collect_phase_times = 0;
+
+// Time and syscalls no single object can be charged with, like loading a batch through io_uring or
+// unmapping a region after its objects are gone. Only part of the process stats, see get_process_stats.
+static uint64_t process_phase_ns[NUM_LOAD_PHASES];
+static uint64_t process_syscalls;
+
+static void add_process_syscalls(uint64_t num_syscalls) {
+    __atomic_add_fetch(&process_syscalls, num_syscalls, __ATOMIC_RELAXED);
+}
+
+static const char *load_phase_names[NUM_LOAD_PHASES] = {
+    [PHASE_LOAD_OBJ] = "load_obj",
+    [PHASE_LOAD_OBJS_URING] = "load_objs_uring",
+    [PHASE_SECTIONS] = "sections",
+    [PHASE_STRIP] = "strip",
+    [PHASE_COUNT_RELOCS] = "count_relocs",
+    [PHASE_RELOCATE] = "relocate",
+    [PHASE_RESOLVE_EXT] = "resolve_ext",
+    [PHASE_MPROTECT] = "mprotect",
+};
+
+struct trace {
+    enum load_phase phase;
+    const char *object;
+    const char *detail;
+    uint64_t start_ns;
+
+    // Enclosing phase on this thread, and the time spent in phases nested in this one
+    struct trace *parent;
+    uint64_t nested_ns;
+};
+
+// Innermost timed phase of this thread
+static __thread struct trace *current_trace = NULL;
+
+static void write_json_string(FILE *f, const char *s) {
+    if(!s) {
+        fputs("null", f);
+        return;
+    }
+
+    putc('"', f);
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') {
+            putc('\\', f);
+            putc(*s, f);
+        } else if((uint8_t)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            putc(*s, f);
+        }
+    }
+    putc('"', f);
+}
+
+static void write_trace_event(const struct trace *trace, uint64_t bytes, uint64_t count, uint64_t ns) {
+    flockfile(trace_file);
+    fputs("{\"phase\":", trace_file);
+    write_json_string(trace_file, load_phase_names[trace->phase]);
+    fputs(",\"object\":", trace_file);
+    write_json_string(trace_file, trace->object);
+    fputs(",\"detail\":", trace_file);
+    write_json_string(trace_file, trace->detail);
+    fprintf(trace_file, ",\"bytes\":%llu,\"count\":%llu,\"ns\":%llu}\n",
+            (unsigned long long)bytes, (unsigned long long)count, (unsigned long long)ns);
+    funlockfile(trace_file);
+}
+
+// Phases are bracketed by trace_start and trace_done. With neither a tracer attached, the event log nor
+// phase times enabled, that costs two nops and a branch.
+static inline void trace_start(struct trace *trace, enum load_phase phase, const char *object, const char *detail) {
+    LOADER_PROBE_START(load_phase_names[phase], object, detail);
+
+    trace->phase = phase;
+    trace->object = object;
+    trace->detail = detail;
+    trace->start_ns = trace_file || collect_phase_times ? now_ns() : 0;
+
+    if(trace->start_ns) {
+        trace->parent = current_trace;
+        trace->nested_ns = 0;
+        current_trace = trace;
+    }
+}
+
+// The duration is added to the phase times of obj, or to those of the process if the phase covers several
+// objects and obj is NULL. Phase times leave out the phases nested in them, such as resolving external
+// symbols while relocating, so that they add up to the total. Trace events report the whole duration.
+static inline void trace_done(const struct trace *trace, struct object *obj, uint64_t bytes, uint64_t count) {
+    LOADER_PROBE_DONE(load_phase_names[trace->phase], trace->object, trace->detail, bytes, count);
+
+    if(trace->start_ns) {
+        uint64_t ns = now_ns() - trace->start_ns;
+
+        current_trace = trace->parent;
+        if(trace->parent) {
+            trace->parent->nested_ns += ns;
+        }
+
+        if(trace_file) {
+            write_trace_event(trace, bytes, count, ns);
+        }
+
+        if(obj) {
+            obj->counters.phase_ns[trace->phase] += ns - trace->nested_ns;
+        } else {
+            __atomic_add_fetch(&process_phase_ns[trace->phase], ns - trace->nested_ns, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int traced_mprotect(struct object *obj, void *addr, size_t size, int prot) {
+    struct trace trace;
+    trace_start(&trace, PHASE_MPROTECT, obj->name, prot & PROT_EXEC ? "r-x" : prot & PROT_WRITE ? "rw-" : "r--");
+
+    int err = mprotect(addr, size, prot);
+
+    trace_done(&trace, obj, size, 1);
+    return err;
+}
+
+static void create_trampoline_func(Trampoline *tramp, uint8_t mov_opcode, uint64_t address, uint32_t offset) {
+    tramp->data[0] = 0x48; // RES.W
+    tramp->data[1] = mov_opcode; // MOV
+    *((uint64_t*)&tramp->data[2]) = address; // 64-bit address
+
+    tramp->data[10] = 0xE9;
+    *((uint32_t*)&tramp->data[11]) = offset; // 32-bit offset
+}
+
+// Runtime address of a symbol defined in a loaded section. IFUNC symbols point at a resolver, which
+// picks the implementation for this CPU.
+static uint8_t *symbol_runtime_address(struct object *obj, const Elf64_Sym *symbol) {
+    uint8_t *address = obj->section_runtime_bases[symbol->st_shndx] + symbol->st_value;
+
+    if(ELF64_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC) {
+        return ((uint8_t *(*)(void))address)();
+    }
+
+    return address;
+}
+
+static void *lookup_function(struct object *obj, const char *name) {
+   size_t name_len = strlen(name);
+
+    // Callers of tiered functions go through the stub, which follows promotion
+    for(int i = 0; obj->tiering && i < obj->tiering->num_functions; i++) {
+        if(!strcmp(name, obj->tiering->functions[i].name)) {
+            return obj->tiering->stubs + i * TIER_STUB_SIZE;
+        }
+    }
+
+    for(int i = 0; i < obj->num_symbols; ++i) {
+        int type = ELF64_ST_TYPE(obj->symbols[i].st_info);
+        if((type == STT_FUNC || type == STT_GNU_IFUNC) && obj->symbols[i].st_shndx < obj->num_sections) {
+            const char *function_name = obj->strtab + obj->symbols[i].st_name;
+            size_t function_name_len = strlen(function_name);
+            if(name_len == function_name_len && !strcmp(name, function_name)) {
+                if(!obj->section_runtime_bases[obj->symbols[i].st_shndx]) {
+                    return NULL;
+                }
+                return symbol_runtime_address(obj, &obj->symbols[i]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Argument of __tls_get_addr, which the global and local dynamic TLS models call
+struct tls_index {
+    uint64_t module;
+    uint64_t offset;
+};
+
+// TLS block of an object, which every thread gets a copy of
+struct tls_module {
+    size_t size;
+    size_t align;
+
+    // .tdata followed by zeroes for .tbss
+    uint8_t *image;
+
+    // Offset of the block from the thread pointer if it lives in static_tls
+    int is_static;
+    intptr_t static_offset;
+
+    // Id with the generation it was handed out in, see TLS_MODULE_ID
+    uint64_t module;
+};
+
+// Module ids in tls_index carry a generation in their upper half. Ids of unloaded objects are reused,
+// the generation tells a thread's block of the old object from the new one's.
+#define TLS_MODULE_ID(module) ((module) & 0xffffffff)
+
+// Indexed by module id, NULL once the object is unloaded until the id is handed out again
+static struct tls_module **tls_modules = NULL;
+static size_t num_tls_modules = 1; // 0 means no module
+static uint64_t tls_generation = 0;
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The local exec and initial exec models address TLS at a fixed offset from the thread pointer, which
+// only the loader's own static TLS has. Objects using them get a slice of this, which every thread has
+// from the start, zeroed. The code reads the slice without asking the loader, so other threads' copies
+// can't be zeroed once it is unloaded. Slices are only reused when the unloading thread is the only one.
+#define STATIC_TLS_SIZE 16384
+static __thread uint8_t static_tls[STATIC_TLS_SIZE] __attribute__((aligned(64)));
+static size_t static_tls_used = 0;
+
+// Slices below static_tls_used which are zero in every thread, sorted by offset and never adjacent
+struct tls_slice {
+    size_t offset;
+    size_t size;
+};
+
+static struct tls_slice *free_static_tls = NULL;
+static size_t num_free_static_tls = 0;
+
+// Blocks of this thread by module id, allocated on first access
+struct tls_block {
+    uint64_t module;
+    uint8_t *block;
+};
+
+static __thread struct tls_block *thread_tls_blocks = NULL;
+static __thread size_t num_thread_tls_blocks = 0;
+static pthread_key_t tls_blocks_key;
+static pthread_once_t tls_blocks_once = PTHREAD_ONCE_INIT;
+
+static int is_static_tls_block(const uint8_t *block) {
+    return block >= static_tls && block < static_tls + STATIC_TLS_SIZE;
+}
+
+static void free_tls_block(struct tls_block *block) {
+    if(!is_static_tls_block(block->block)) {
+        free(block->block);
+    }
+    block->block = NULL;
+    block->module = 0;
+}
+
+static void free_thread_tls_blocks(void *unused) {
+    (void)unused;
+
+    for(size_t i = 0; i < num_thread_tls_blocks; i++) {
+        free_tls_block(&thread_tls_blocks[i]);
+    }
+    free(thread_tls_blocks);
+    thread_tls_blocks = NULL;
+    num_thread_tls_blocks = 0;
+}
+
+static void create_tls_blocks_key(void) {
+    pthread_key_create(&tls_blocks_key, free_thread_tls_blocks);
+}
+
+static uint8_t *allocate_tls_block(uint64_t module_id) {
+    pthread_once(&tls_blocks_once, create_tls_blocks_key);
+
+    size_t id = TLS_MODULE_ID(module_id);
+
+    pthread_mutex_lock(&tls_lock);
+    struct tls_module *module = id < num_tls_modules ? tls_modules[id] : NULL;
+    if(!module || module->module != module_id) {
+        fprintf(stderr, "No TLS module %zu\n", id);
+        exit(ENOENT);
+    }
+
+    // Blocks of objects unloaded by other threads are only noticed here
+    for(size_t i = 0; i < num_thread_tls_blocks; i++) {
+        if(thread_tls_blocks[i].block && (!tls_modules[i] || tls_modules[i]->module != thread_tls_blocks[i].module)) {
+            free_tls_block(&thread_tls_blocks[i]);
+        }
+    }
+
+    uint8_t *block;
+    if(module->is_static) {
+        block = (uint8_t *)__builtin_thread_pointer() + module->static_offset;
+    } else {
+        block = aligned_alloc(module->align, align_to(module->size, module->align));
+        if(!block) {
+            perror("Failed to allocate TLS block");
+            exit(errno);
+        }
+        memcpy(block, module->image, module->size);
+    }
+    pthread_mutex_unlock(&tls_lock);
+
+    if(id >= num_thread_tls_blocks) {
+        size_t num_blocks = id + 16;
+        thread_tls_blocks = realloc(thread_tls_blocks, num_blocks * sizeof(struct tls_block));
+        if(!thread_tls_blocks) {
+            perror("Failed to allocate TLS blocks");
+            exit(errno);
+        }
+        memset(thread_tls_blocks + num_thread_tls_blocks, 0, (num_blocks - num_thread_tls_blocks) * sizeof(struct tls_block));
+        num_thread_tls_blocks = num_blocks;
+
+        // Only there to have the blocks freed when the thread exits
+        pthread_setspecific(tls_blocks_key, thread_tls_blocks);
+    }
+
+    thread_tls_blocks[id] = (struct tls_block){ module_id, block };
+    return block;
+}
+
+// The loaded objects' __tls_get_addr. The block of an object is allocated the first time a thread
+// accesses its TLS.
+static void *tls_get_addr(struct tls_index *index) {
+    size_t id = TLS_MODULE_ID(index->module);
+    if(id < num_thread_tls_blocks && thread_tls_blocks[id].module == index->module) {
+        return thread_tls_blocks[id].block + index->offset;
+    }
+
+    return allocate_tls_block(index->module) + index->offset;
+}
+
+// Takes a slice of static TLS, from the freed ones if one fits. Called with tls_lock held.
+static int allocate_static_tls(size_t size, size_t align, size_t *offset) {
+    for(size_t i = 0; i < num_free_static_tls; i++) {
+        struct tls_slice slice = free_static_tls[i];
+        size_t start = align_to(slice.offset, align);
+        if(start + size > slice.offset + slice.size) {
+            continue;
+        }
+
+        // What is left before and after the block stays free
+        struct tls_slice rest[] = { { slice.offset, start - slice.offset },
+                                    { start + size, slice.offset + slice.size - start - size } };
+        int num_rest = !!rest[0].size + !!rest[1].size;
+        if(num_rest == 2) {
+            free_static_tls = realloc(free_static_tls, (num_free_static_tls + 1) * sizeof(struct tls_slice));
+            if(!free_static_tls) {
+                perror("Failed to allocate static TLS slices");
+                exit(errno);
+            }
+        }
+        memmove(free_static_tls + i + num_rest, free_static_tls + i + 1, (num_free_static_tls - i - 1) * sizeof(struct tls_slice));
+        for(int r = 0, j = i; r < 2; r++) {
+            if(rest[r].size) {
+                free_static_tls[j++] = rest[r];
+            }
+        }
+        num_free_static_tls += num_rest - 1;
+
+        *offset = start;
+        return 0;
+    }
+
+    *offset = align_to(static_tls_used, align);
+    if(align > 64 || *offset + size > STATIC_TLS_SIZE) {
+        return ENOMEM;
+    }
+    static_tls_used = *offset + size;
+
+    return 0;
+}
+
+// Returns a slice to the free ones, merging it with its neighbours. Called with tls_lock held.
+static void free_static_tls_slice(size_t offset, size_t size) {
+    size_t i = 0;
+    while(i < num_free_static_tls && free_static_tls[i].offset < offset) {
+        i++;
+    }
+
+    int merge_prev = i > 0 && free_static_tls[i - 1].offset + free_static_tls[i - 1].size == offset;
+    int merge_next = i < num_free_static_tls && offset + size == free_static_tls[i].offset;
+
+    if(merge_prev && merge_next) {
+        free_static_tls[i - 1].size += size + free_static_tls[i].size;
+        memmove(free_static_tls + i, free_static_tls + i + 1, (num_free_static_tls - i - 1) * sizeof(struct tls_slice));
+        num_free_static_tls--;
+    } else if(merge_prev) {
+        free_static_tls[i - 1].size += size;
+    } else if(merge_next) {
+        free_static_tls[i].offset = offset;
+        free_static_tls[i].size += size;
+    } else {
+        free_static_tls = realloc(free_static_tls, (num_free_static_tls + 1) * sizeof(struct tls_slice));
+        if(!free_static_tls) {
+            perror("Failed to allocate static TLS slices");
+            exit(errno);
+        }
+        memmove(free_static_tls + i + 1, free_static_tls + i, (num_free_static_tls - i) * sizeof(struct tls_slice));
+        free_static_tls[i] = (struct tls_slice){ offset, size };
+        num_free_static_tls++;
+    }
+
+    // A slice at the end goes back to the unused part
+    struct tls_slice *last = &free_static_tls[num_free_static_tls - 1];
+    if(last->offset + last->size == static_tls_used) {
+        static_tls_used = last->offset;
+        num_free_static_tls--;
+    }
+}
+
+// Number of threads of the process, -1 if it can't be told
+static int count_threads(void) {
+    DIR *dir = opendir("/proc/self/task");
+    if(!dir) {
+        return -1;
+    }
+
+    int num_threads = 0;
+    for(struct dirent *entry; (entry = readdir(dir));) {
+        num_threads += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+
+    return num_threads;
+}
+
+// Lays out the TLS sections of an object into a block and registers it as a module
+static void register_tls_module(struct object *obj) {
+    size_t size = 0, align = 1;
+    int has_data = 0;
+
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        const Elf64_Shdr *section = &obj->sections[i];
+        if(!(section->sh_flags & SHF_TLS) || !(section->sh_flags & SHF_ALLOC) || !section->sh_size) {
+            continue;
+        }
+
+        if(!obj->tls_offsets) {
+            obj->tls_offsets = calloc(obj->num_sections, sizeof(size_t));
+            if(!obj->tls_offsets) {
+                perror("Failed to allocate TLS offsets");
+                exit(errno);
+            }
+        }
+
+        size = align_to(size, section->sh_addralign);
+        obj->tls_offsets[i] = size;
+        size += section->sh_size;
+
+        if(section->sh_addralign > align) {
+            align = section->sh_addralign;
+        }
+
+        if(section->sh_type != SHT_NOBITS) {
+            for(uint64_t b = 0; b < section->sh_size; b++) {
+                has_data |= obj->base[section->sh_offset + b];
+            }
+        }
+    }
+
+    if(!obj->tls_offsets) {
+        return;
+    }
+
+    struct tls_module *module = calloc(1, sizeof(struct tls_module));
+    if(!module || !(module->image = calloc(1, size))) {
+        perror("Failed to allocate TLS module");
+        exit(errno);
+    }
+    module->size = size;
+    module->align = align < sizeof(void *) ? sizeof(void *) : align;
+
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        const Elf64_Shdr *section = &obj->sections[i];
+        if((section->sh_flags & SHF_TLS) && (section->sh_flags & SHF_ALLOC) && section->sh_type != SHT_NOBITS) {
+            memcpy(module->image + obj->tls_offsets[i], obj->base + section->sh_offset, section->sh_size);
+        }
+    }
+
+    pthread_mutex_lock(&tls_lock);
+
+    if(obj->num_static_tls_relocs) {
+        // Threads which already exist only have zeroes in their static TLS
+        if(has_data) {
+            fprintf(stderr, "\"%s\" initializes thread locals, which needs the global dynamic TLS model (-fPIC)\n", obj->name);
+            exit(ENOEXEC);
+        }
+
+        size_t offset;
+        if(allocate_static_tls(size, module->align, &offset)) {
+            fprintf(stderr, "\"%s\" does not fit into the static TLS left\n", obj->name);
+            exit(ENOMEM);
+        }
+
+        module->is_static = 1;
+        module->static_offset = (static_tls + offset) - (uint8_t *)__builtin_thread_pointer();
+        obj->tls_static_offset = module->static_offset;
+    }
+
+    size_t id = 1;
+    while(id < num_tls_modules && tls_modules[id]) {
+        id++;
+    }
+
+    if(id == num_tls_modules) {
+        if(!(num_tls_modules & (num_tls_modules - 1))) {
+            tls_modules = realloc(tls_modules, 2 * num_tls_modules * sizeof(struct tls_module *));
+            if(!tls_modules) {
+                perror("Failed to allocate TLS modules");
+                exit(errno);
+            }
+        }
+        num_tls_modules++;
+    }
+
+    module->module = ++tls_generation << 32 | id;
+    obj->tls_module = module->module;
+    tls_modules[id] = module;
+
+    pthread_mutex_unlock(&tls_lock);
+}
+
+// Drops the TLS module of an unloaded object, so that its id can be handed out again. Only the calling
+// thread's block is freed, the blocks of other threads are freed the next time they allocate one or
+// when they exit.
+static void unregister_tls_module(struct object *obj) {
+    size_t id = TLS_MODULE_ID(obj->tls_module);
+
+    if(id < num_thread_tls_blocks && thread_tls_blocks[id].module == obj->tls_module) {
+        free_tls_block(&thread_tls_blocks[id]);
+    }
+
+    pthread_mutex_lock(&tls_lock);
+
+    struct tls_module *module = tls_modules[id];
+    if(module->is_static && count_threads() == 1) {
+        uint8_t *block = (uint8_t *)__builtin_thread_pointer() + module->static_offset;
+        memset(block, 0, module->size);
+        free_static_tls_slice(block - static_tls, module->size);
+    }
+
+    free(module->image);
+    free(module);
+    tls_modules[id] = NULL;
+
+    pthread_mutex_unlock(&tls_lock);
+
+    obj->tls_module = 0;
+}
+
+// The CPU model libgcc fills in, read by the resolvers GCC generates for target_clones and
+// __builtin_cpu_supports. Both are linked into the loader because it uses __builtin_cpu_supports itself.
+extern char libgcc_cpu_model[] __asm__("__cpu_model");
+extern int libgcc_cpu_indicator_init(void) __asm__("__cpu_indicator_init");
+
+// Symbols the loaded objects may reference outside of themselves
+struct ext_symbol {
+    const char *name;
+    void *addr;
+};
+
+static const struct ext_symbol ext_symbols[] = {
+    { "puts", my_puts },
+    { "__cpu_model", libgcc_cpu_model },
+    { "__cpu_indicator_init", libgcc_cpu_indicator_init },
+    { "__tls_get_addr", tls_get_addr },
+};
+
+static void *lookup_ext_function(struct object *obj, const char *name) {
+    struct trace trace;
+    trace_start(&trace, PHASE_RESOLVE_EXT, obj->name, name);
+
+    for(size_t i = 0; i < sizeof(ext_symbols) / sizeof(ext_symbols[0]); i++) {
+        if(!strcmp(name, ext_symbols[i].name)) {
+            trace_done(&trace, obj, 0, 1);
+            return ext_symbols[i].addr;
+        }
+    }
+
+    fprintf(stderr, "No address for function %s\n", name);
+    exit(ENOENT);
+}
+
+static const Elf64_Shdr *lookup_section(struct object *obj, const char *name) {
+    size_t name_len = strlen(name);
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        const char *section_name = obj->shstrtab + obj->sections[i].sh_name;
+        size_t section_name_len = strlen(section_name);
+
+        if(name_len == section_name_len && !strcmp(name, section_name)) {
+            if(obj->sections[i].sh_size) {
+                return obj->sections + i;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static enum section_class classify_section(struct object *obj, const Elf64_Shdr *section) {
+    if(!(section->sh_flags & SHF_ALLOC) || !section->sh_size) {
+        return SECTION_SKIP;
+    }
+
+    // TLS sections are not part of the region, every thread gets a copy of its own, see tls_get_addr
+    if(section->sh_flags & SHF_TLS) {
+        return SECTION_SKIP;
+    }
+
+    // The unwind info is never registered with the unwinder, so there is no point in loading it
+    if(!strcmp(obj->shstrtab + section->sh_name, ".eh_frame")) {
+        return SECTION_SKIP;
+    }
+
+    if(obj->live_sections && !obj->live_sections[section - obj->sections]) {
+        return SECTION_SKIP;
+    }
+
+    if(section->sh_flags & SHF_EXECINSTR) {
+        return SECTION_EXEC;
+    }
+
+    if(section->sh_flags & SHF_WRITE) {
+        return SECTION_DATA;
+    }
+
+    return SECTION_RODATA;
+}
+
+// Relocation sections are only processed when the section they patch gets loaded
+static int is_loaded_rela(struct object *obj, const Elf64_Shdr *section) {
+    return section->sh_type == SHT_RELA && section->sh_info < obj->num_sections &&
+           classify_section(obj, &obj->sections[section->sh_info]) != SECTION_SKIP;
+}
+
+static void count_absolute_relocations(struct object *obj) {
+    for(Elf64_Half s = 0; s < obj->num_sections; s++) {
+        // Trampolines only work for instructions, so only executable sections need them
+        if(!is_loaded_rela(obj, &obj->sections[s]) || classify_section(obj, &obj->sections[obj->sections[s].sh_info]) != SECTION_EXEC) {
+            continue;
+        }
+
+        int num_relocations = obj->sections[s].sh_size / obj->sections[s].sh_entsize;
+        const Elf64_Rela *relocations = (Elf64_Rela *)(obj->base + obj->sections[s].sh_offset);
+
+        for(int i = 0; i < num_relocations; i++) {
+            int type = ELF64_R_TYPE(relocations[i].r_info);
+            if(type == R_X86_64_32) {
+                obj->num_absolute_relocs++;
+            }
+        }
+    }
+}
+
+// GOT relocations need a slot holding the symbol address, which the jumptable entries provide
+static int is_got_relocation(int type) {
+    return type == R_X86_64_GOTPCREL || type == R_X86_64_GOTPCRELX || type == R_X86_64_REX_GOTPCRELX;
+}
+
+static int is_tls_relocation(int type) {
+    switch(type) {
+        case R_X86_64_TLSGD:
+        case R_X86_64_TLSLD:
+        case R_X86_64_DTPOFF32:
+        case R_X86_64_DTPOFF64:
+        case R_X86_64_GOTTPOFF:
+        case R_X86_64_TPOFF32:
+        case R_X86_64_TPOFF64:
+            return 1;
+    }
+
+    return 0;
+}
+
+// The TLS block has to be at a fixed offset from the thread pointer for the initial and local exec models
+static int is_static_tls_relocation(int type) {
+    return type == R_X86_64_GOTTPOFF || type == R_X86_64_TPOFF32 || type == R_X86_64_TPOFF64;
+}
+
+static int is_ifunc_relocation(struct object *obj, const Elf64_Rela *rela) {
+    const Elf64_Sym *symbol = &obj->symbols[ELF64_R_SYM(rela->r_info)];
+
+    return ELF64_R_TYPE(rela->r_info) == R_X86_64_IRELATIVE ||
+           (ELF64_ST_TYPE(symbol->st_info) == STT_GNU_IFUNC && symbol->st_shndx != SHN_UNDEF);
+}
+
+static void count_external_symbols(struct object *obj) {
+    for(Elf64_Half s = 0; s < obj->num_sections; s++) {
+        if(!is_loaded_rela(obj, &obj->sections[s])) {
+            continue;
+        }
+
+        int num_relocs = obj->sections[s].sh_size / obj->sections[s].sh_entsize;
+        const Elf64_Rela *relocs = (Elf64_Rela *)(obj->base + obj->sections[s].sh_offset);
+
+        int is_exec = classify_section(obj, &obj->sections[obj->sections[s].sh_info]) == SECTION_EXEC;
+
+        for(int i = 0; i < num_relocs; i++) {
+            int symbol_idx = ELF64_R_SYM(relocs[i].r_info);
+            int type = ELF64_R_TYPE(relocs[i].r_info);
+            // TLS relocations against the GOT get a jumptable entry too, see do_tls_relocation
+            if(is_got_relocation(type) || type == R_X86_64_TLSGD || type == R_X86_64_TLSLD || type == R_X86_64_GOTTPOFF ||
+               (obj->symbols[symbol_idx].st_shndx == SHN_UNDEF && (is_exec || type != R_X86_64_64))) {
+                obj->num_ext_symbols++;
+            }
+
+            if(is_static_tls_relocation(type)) {
+                obj->num_static_tls_relocs++;
+            }
+
+            // A GOT slot of an IFUNC symbol is filled in by a relocation of its own
+            if(is_ifunc_relocation(obj, &relocs[i])) {
+                obj->num_ifunc_relocs++;
+            }
+        }
+    }
+}
+
+// Bytes a relocation patches at r_offset. R_X86_64_32 may also rewrite the opcode before it, see apply_relocation.
+static int relocation_width(int type) {
+    switch(type) {
+        case R_X86_64_64:
+        case R_X86_64_PC64:
+        case R_X86_64_DTPOFF64:
+        case R_X86_64_TPOFF64:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+// A string table has to end in a NUL, so that every name in it does
+static int is_string_table(const uint8_t *buf, const Elf64_Shdr *section) {
+    return section->sh_type != SHT_NOBITS && section->sh_size && !buf[section->sh_offset + section->sh_size - 1];
+}
+
+// Same rule as lookup_section: the first section of that name which is not empty
+static const Elf64_Shdr *find_image_section(const uint8_t *buf, const Elf64_Ehdr *hdr, const char *name) {
+    const Elf64_Shdr *sections = (const Elf64_Shdr *)(buf + hdr->e_shoff);
+    const char *shstrtab = (const char *)buf + sections[hdr->e_shstrndx].sh_offset;
+
+    for(Elf64_Half i = 0; i < hdr->e_shnum; i++) {
+        if(!strcmp(shstrtab + sections[i].sh_name, name) && sections[i].sh_size) {
+            return &sections[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns 0 if the buffer holds a relocatable x86-64 ELF object, ENOEXEC after reporting what is wrong otherwise.
+// The image may come from another process: every index, offset and name the loader follows is checked
+// to stay within the buffer and the tables it points into.
+static int check_obj_image(const void *buf, size_t size, const char *name) {
+    const Elf64_Ehdr *hdr = buf;
+
+    if(size < sizeof(Elf64_Ehdr) || memcmp(hdr->e_ident, ELFMAG, SELFMAG)) {
+        fprintf(stderr, "\"%s\" is not an ELF file\n", name);
+        return ENOEXEC;
+    }
+
+    if(hdr->e_ident[EI_CLASS] != ELFCLASS64 || hdr->e_type != ET_REL || hdr->e_machine != EM_X86_64) {
+        fprintf(stderr, "\"%s\" is not a x86-64 relocatable object\n", name);
+        return ENOEXEC;
+    }
+
+    if(hdr->e_shoff > size || (uint64_t)hdr->e_shnum * sizeof(Elf64_Shdr) > size - hdr->e_shoff ||
+       hdr->e_shstrndx >= hdr->e_shnum) {
+        fprintf(stderr, "\"%s\" is truncated\n", name);
+        return ENOEXEC;
+    }
+
+    const Elf64_Shdr *sections = (const Elf64_Shdr *)((const uint8_t *)buf + hdr->e_shoff);
+    for(Elf64_Half i = 0; i < hdr->e_shnum; i++) {
+        if(sections[i].sh_type != SHT_NOBITS &&
+           (sections[i].sh_offset > size || sections[i].sh_size > size - sections[i].sh_offset)) {
+            fprintf(stderr, "Section %u of \"%s\" is truncated\n", i, name);
+            return ENOEXEC;
+        }
+
+        if((sections[i].sh_type == SHT_RELA && sections[i].sh_entsize != sizeof(Elf64_Rela)) ||
+           (sections[i].sh_type == SHT_SYMTAB && sections[i].sh_entsize != sizeof(Elf64_Sym))) {
+            fprintf(stderr, "Section %u of \"%s\" has the wrong entry size\n", i, name);
+            return ENOEXEC;
+        }
+
+        if(sections[i].sh_type == SHT_RELA && sections[i].sh_info >= hdr->e_shnum) {
+            fprintf(stderr, "Relocations in section %u of \"%s\" target no section\n", i, name);
+            return ENOEXEC;
+        }
+    }
+
+    const uint8_t *image = buf;
+    const Elf64_Shdr *shstrtab_hdr = &sections[hdr->e_shstrndx];
+    if(!is_string_table(image, shstrtab_hdr)) {
+        fprintf(stderr, "Section names of \"%s\" are not a string table\n", name);
+        return ENOEXEC;
+    }
+
+    for(Elf64_Half i = 0; i < hdr->e_shnum; i++) {
+        if(sections[i].sh_name >= shstrtab_hdr->sh_size) {
+            fprintf(stderr, "Name of section %u of \"%s\" is out of bounds\n", i, name);
+            return ENOEXEC;
+        }
+    }
+
+    const Elf64_Shdr *symtab_hdr = find_image_section(image, hdr, ".symtab");
+    const Elf64_Shdr *strtab_hdr = find_image_section(image, hdr, ".strtab");
+    if(!symtab_hdr || !strtab_hdr || symtab_hdr->sh_type != SHT_SYMTAB || !is_string_table(image, strtab_hdr)) {
+        fprintf(stderr, "\"%s\" has no symbols or strings table\n", name);
+        return ENOEXEC;
+    }
+
+    const Elf64_Sym *symbols = (const Elf64_Sym *)(image + symtab_hdr->sh_offset);
+    size_t num_symbols = symtab_hdr->sh_size / sizeof(Elf64_Sym);
+    for(size_t i = 0; i < num_symbols; i++) {
+        if(symbols[i].st_name >= strtab_hdr->sh_size) {
+            fprintf(stderr, "Name of symbol %zu of \"%s\" is out of bounds\n", i, name);
+            return ENOEXEC;
+        }
+
+        if(symbols[i].st_shndx != SHN_UNDEF && symbols[i].st_shndx != SHN_ABS && symbols[i].st_shndx >= hdr->e_shnum) {
+            fprintf(stderr, "Symbol %s of \"%s\" is in an unsupported section\n",
+                    (const char *)image + strtab_hdr->sh_offset + symbols[i].st_name, name);
+            return ENOEXEC;
+        }
+    }
+
+    for(Elf64_Half i = 0; i < hdr->e_shnum; i++) {
+        if(sections[i].sh_type != SHT_RELA) {
+            continue;
+        }
+
+        const Elf64_Rela *relocations = (const Elf64_Rela *)(image + sections[i].sh_offset);
+        const Elf64_Shdr *target = &sections[sections[i].sh_info];
+        for(size_t r = 0; r < sections[i].sh_size / sizeof(Elf64_Rela); r++) {
+            int type = ELF64_R_TYPE(relocations[r].r_info);
+            uint64_t offset = relocations[r].r_offset;
+
+            if(ELF64_R_SYM(relocations[r].r_info) >= num_symbols || offset > target->sh_size ||
+               (uint64_t)relocation_width(type) > target->sh_size - offset || (type == R_X86_64_32 && !offset)) {
+                fprintf(stderr, "Relocation %zu in section %u of \"%s\" is out of bounds\n", r, i, name);
+                return ENOEXEC;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static struct object *new_obj(const void *buf, size_t size, const char *name) {
+    struct object *obj = calloc(1, sizeof(struct object));
+    if(!obj) {
+        perror("Failed to allocate object");
+        exit(errno);
+    }
+
+    obj->name = strdup(name);
+    obj->base = buf;
+    obj->size = size;
+    obj->source = SOURCE_BORROWED;
+    obj->num_sections = ((const Elf64_Ehdr *)buf)->e_shnum;
+
+    return obj;
+}
+
+// Checks that the buffer holds a relocatable x86-64 ELF object and creates an object for it.
+// The buffer is borrowed, not copied: it has to stay valid for as long as the object is in use.
+static struct object *load_obj_mem(const void *buf, size_t size, const char *name) {
+    if(check_obj_image(buf, size, name)) {
+        exit(ENOEXEC);
+    }
+
+    return new_obj(buf, size, name);
+}
+
+// Reads an object from a descriptor which can't be mapped, e.g. a pipe or a socket
+static struct object *try_read_obj_fd(int fd, const char *name, int *error) {
+    size_t capacity = page_size, size = 0;
+    int num_reads = 0;
+    uint8_t *base = malloc(capacity);
+    for(;;) {
+        if(size == capacity) {
+            capacity *= 2;
+            base = realloc(base, capacity);
+        }
+
+        if(!base) {
+            perror("Failed to allocate memory for object file");
+            exit(errno);
+        }
+
+        ssize_t n = read(fd, base + size, capacity - size);
+        num_reads++;
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            *error = errno;
+            perror("Failed to read object file");
+            fprintf(stderr, "File \"%s\"\n", name);
+            free(base);
+            return NULL;
+        }
+
+        if(n == 0) {
+            break;
+        }
+
+        size += n;
+    }
+
+    if((*error = check_obj_image(base, size, name))) {
+        free(base);
+        return NULL;
+    }
+
+    struct object *obj = new_obj(base, size, name);
+    obj->source = SOURCE_MALLOCED;
+    obj->counters.num_syscalls += 1 + num_reads;
+    return obj;
+}
+
+// Regular files are mapped with map_flags added, anything that can't be mapped is read into memory.
+// Returns NULL with the errno in *error if the file can't be read or is no valid object.
+static struct object *try_map_obj_fd(int fd, const char *name, int map_flags, int *error) {
+    struct trace trace;
+    trace_start(&trace, PHASE_LOAD_OBJ, name, NULL);
+
+    struct object *obj = NULL;
+    struct stat sb;
+
+    if(fstat(fd, &sb)) {
+        *error = errno;
+        perror("Failed to get object file info");
+        fprintf(stderr, "File \"%s\"\n", name);
+    } else if(S_ISREG(sb.st_mode)) {
+        void *base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE | map_flags, fd, 0);
+        if(base == MAP_FAILED) {
+            *error = errno;
+            perror("Failed to map object file");
+            fprintf(stderr, "File \"%s\"\n", name);
+        } else if((*error = check_obj_image(base, sb.st_size, name))) {
+            munmap(base, sb.st_size);
+        } else {
+            obj = new_obj(base, sb.st_size, name);
+            obj->source = SOURCE_MAPPED;
+            obj->counters.num_syscalls += 2;
+        }
+    } else {
+        obj = try_read_obj_fd(fd, name, error);
+    }
+
+    trace_done(&trace, obj, obj ? obj->size : 0, !!obj);
+    return obj;
+}
+
+// Loads the object from an already open file descriptor, e.g. a memfd or a descriptor received over IPC.
+// The descriptor stays owned by the caller.
+static struct object *load_obj_fd(int fd, const char *name) {
+    int error;
+    struct object *obj = try_map_obj_fd(fd, name, 0, &error);
+    if(!obj) {
+        exit(error);
+    }
+
+    return obj;
+}
+
+static struct object *try_open_obj(const char *file, int map_flags, int *error) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        *error = errno;
+        perror("Failed to open object file.");
+        fprintf(stderr, "File \"%s\"\n", file);
+        return NULL;
+    }
+
+    struct object *obj = try_map_obj_fd(fd, file, map_flags, error);
+
+    close(fd);
+    if(obj) {
+        obj->counters.num_syscalls += 2;
+    }
+
+    return obj;
+}
+
+static struct object *open_obj(const char *file, int map_flags) {
+    int error;
+    struct object *obj = try_open_obj(file, map_flags, &error);
+    if(!obj) {
+        exit(error);
+    }
+
+    return obj;
+}
+
+static struct object *load_obj(const char* file) {
+    return open_obj(file, 0);
+}
+
+// CPU features a variant in a manifest can require
+struct cpu_feature {
+    const char *name;
+    int supported;
+};
+
+static struct cpu_feature cpu_features[] = {
+    { "default", 0 },
+    { "sse4.2", 0 },
+    { "avx", 0 },
+    { "avx2", 0 },
+    { "fma", 0 },
+    { "avx512f", 0 },
+    { "avx512bw", 0 },
+    { "avx512vl", 0 },
+};
+static pthread_once_t cpu_features_once = PTHREAD_ONCE_INIT;
+
+// __builtin_cpu_supports only takes literals, so every feature is queried once up front
+static void detect_cpu_features(void) {
+    __builtin_cpu_init();
+
+    cpu_features[0].supported = 1;
+    cpu_features[1].supported = __builtin_cpu_supports("sse4.2");
+    cpu_features[2].supported = __builtin_cpu_supports("avx");
+    cpu_features[3].supported = __builtin_cpu_supports("avx2");
+    cpu_features[4].supported = __builtin_cpu_supports("fma");
+    cpu_features[5].supported = __builtin_cpu_supports("avx512f");
+    cpu_features[6].supported = __builtin_cpu_supports("avx512bw");
+    cpu_features[7].supported = __builtin_cpu_supports("avx512vl");
+}
+
+// Features are separated by '+', e.g. "avx2+fma"
+static int cpu_supports(const char *features) {
+    pthread_once(&cpu_features_once, detect_cpu_features);
+
+    while(*features) {
+        size_t len = strcspn(features, "+");
+        int found = 0;
+
+        for(size_t i = 0; i < sizeof(cpu_features) / sizeof(cpu_features[0]); i++) {
+            if(strlen(cpu_features[i].name) == len && !strncmp(features, cpu_features[i].name, len)) {
+                if(!cpu_features[i].supported) {
+                    return 0;
+                }
+                found = 1;
+            }
+        }
+
+        // A variant built for something the loader can't check for is never picked
+        if(!found) {
+            return 0;
+        }
+
+        features += len;
+        features += *features == '+';
+    }
+
+    return 1;
+}
+
+// Loads the best variant of an object for this CPU. Every line of the manifest names the features a
+// variant needs and its path relative to the manifest, best variant first:
+//
+//     avx512f kernels_avx512.o
+//     avx2+fma kernels_avx2.o
+//     default kernels_default.o
+//
+// The first variant the CPU supports is loaded.
+static struct object *load_variant(const char *manifest) {
+    FILE *f = fopen(manifest, "r");
+    if(!f) {
+        perror("Failed to open manifest");
+        fprintf(stderr, "File \"%s\"\n", manifest);
+        exit(errno);
+    }
+
+    const char *slash = strrchr(manifest, '/');
+    int dir_len = slash ? slash - manifest + 1 : 0;
+
+    char line[512], features[128], file[256], path[512];
+
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] == '#' || sscanf(line, "%127s %255s", features, file) != 2) {
+            continue;
+        }
+
+        if(cpu_supports(features)) {
+            fclose(f);
+
+            if(file[0] == '/') {
+                return load_obj(file);
+            }
+
+            snprintf(path, sizeof(path), "%.*s%s", dir_len, manifest, file);
+            return load_obj(path);
+        }
+    }
+
+    fclose(f);
+
+    fprintf(stderr, "No variant in \"%s\" runs on this CPU\n", manifest);
+    exit(ENOEXEC);
+}
+
+// How load_objs gets the object files into memory
+enum load_io_mode {
+    LOAD_IO_MMAP,     // open, fstat and mmap every file, pages are faulted in on first touch
+    LOAD_IO_POPULATE, // same, but MAP_POPULATE reads the pages in before parsing
+    LOAD_IO_URING,    // batched openat, statx and read into an arena per ring full of files through io_uring
+};
+
+// Just enough of io_uring to push batches of requests through the kernel
+struct uring {
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    uint8_t *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+
+    // Setup, ring mappings and io_uring_enter calls so far
+    int num_syscalls;
+};
+
+static int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    ring->num_syscalls = 1;
+    if(ring->fd < 0) {
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with a single mmap
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->num_syscalls++;
+    if(ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->cq_ring = ring->sq_ring;
+    if(ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        ring->num_syscalls++;
+        if(ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->num_syscalls++;
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cq_ring_size) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_tail = (unsigned *)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_ring + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_exit(struct uring *ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if(ring->cq_ring_size) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+        ring->num_syscalls++;
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->num_syscalls += 3;
+}
+
+// Pushes num_ops requests through the ring, at most a ring full at a time.
+// prep fills in the submission for request i and done receives its result.
+static void uring_run(struct uring *ring, int num_ops,
+                      void (*prep)(struct io_uring_sqe *sqe, int i, void *ctx),
+                      void (*done)(int i, int res, void *ctx), void *ctx) {
+    for(int first = 0; first < num_ops; first += ring->entries) {
+        unsigned batch = num_ops - first < (int)ring->entries ? (unsigned)(num_ops - first) : ring->entries;
+        unsigned tail = *ring->sq_tail;
+
+        for(unsigned i = 0; i < batch; i++) {
+            unsigned idx = (tail + i) & *ring->sq_mask;
+            memset(&ring->sqes[idx], 0, sizeof(struct io_uring_sqe));
+            prep(&ring->sqes[idx], first + i, ctx);
+            ring->sqes[idx].user_data = first + i;
+            ring->sq_array[idx] = idx;
+        }
+        __atomic_store_n(ring->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0, completed = 0;
+        while(completed < batch) {
+            int ret = syscall(__NR_io_uring_enter, ring->fd, batch - submitted, batch - completed,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            ring->num_syscalls++;
+            if(ret < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                perror("Failed to submit io_uring requests");
+                exit(errno);
+            }
+            submitted += ret;
+
+            unsigned head = *ring->cq_head;
+            unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            for(; head != cq_tail; head++, completed++) {
+                const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                done(cqe->user_data, cqe->res, ctx);
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// State of a load_objs call going through io_uring, for the ring full of files being loaded
+struct uring_load {
+    const char **files;
+    int *fds;
+    struct statx *stats;
+    uint8_t **bufs;
+    size_t *num_read;
+
+    // Files which still have bytes left to read
+    int *pending;
+    int num_pending;
+
+    // Set when the kernel does not know the openat or statx operations
+    int unsupported;
+};
+
+// Opens and stats every file in a single batch, request 2i opens file i and request 2i + 1 stats it
+static void uring_prep_open(struct io_uring_sqe *sqe, int i, void *ctx) {
+    struct uring_load *load = ctx;
+
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)load->files[i / 2];
+    if(i % 2 == 0) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->open_flags = O_RDONLY;
+    } else {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->len = STATX_SIZE;
+        sqe->off = (uintptr_t)&load->stats[i / 2];
+    }
+}
+
+static void uring_done_open(int i, int res, void *ctx) {
+    struct uring_load *load = ctx;
+
+    // Kernels before 5.6 reject the operations they don't know with EINVAL
+    if(res == -EINVAL) {
+        load->unsupported = 1;
+        return;
+    }
+
+    if(res < 0) {
+        fprintf(stderr, "Failed to %s object file \"%s\": %s\n", i % 2 ? "stat" : "open", load->files[i / 2], strerror(-res));
+        exit(-res);
+    }
+
+    if(i % 2 == 0) {
+        load->fds[i / 2] = res;
+    }
+}
+
+static void uring_prep_read(struct io_uring_sqe *sqe, int i, void *ctx) {
+    struct uring_load *load = ctx;
+    int file = load->pending[i];
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = load->fds[file];
+    sqe->addr = (uintptr_t)(load->bufs[file] + load->num_read[file]);
+    sqe->len = load->stats[file].stx_size - load->num_read[file];
+    sqe->off = load->num_read[file];
+}
+
+static void uring_done_read(int i, int res, void *ctx) {
+    struct uring_load *load = ctx;
+    int file = load->pending[i];
+
+    if(res <= 0) {
+        fprintf(stderr, "Failed to read object file \"%s\": %s\n", load->files[file], res ? strerror(-res) : "file is truncated");
+        exit(res ? -res : EIO);
+    }
+
+    load->num_read[file] += res;
+}
+
+static void uring_prep_close(struct io_uring_sqe *sqe, int i, void *ctx) {
+    struct uring_load *load = ctx;
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = load->fds[i];
+}
+
+static void uring_done_close(int i, int res, void *ctx) {
+    (void)i;
+    (void)res;
+    (void)ctx;
+}
+
+// Reads a ring full of files into an arena of their own with three round trips to the kernel:
+// open and statx, read (repeated for short reads), close. Returns 0 if the kernel lacks openat or statx,
+// nothing is loaded then and no descriptor is left open.
+static int load_objs_uring_batch(struct uring *ring, struct uring_load *load, int num_files, struct object **objs) {
+    for(int i = 0; i < num_files; i++) {
+        load->fds[i] = -1;
+        load->num_read[i] = 0;
+    }
+
+    uring_run(ring, 2 * num_files, uring_prep_open, uring_done_open, load);
+
+    if(load->unsupported) {
+        for(int i = 0; i < num_files; i++) {
+            if(load->fds[i] >= 0) {
+                close(load->fds[i]);
+            }
+        }
+        return 0;
+    }
+
+    size_t arena_size = 0;
+    for(int i = 0; i < num_files; i++) {
+        arena_size += align_to(load->stats[i].stx_size, 16);
+    }
+
+    struct object_arena *arena = malloc(sizeof(struct object_arena));
+    if(!arena) {
+        perror("Failed to allocate object file arena");
+        exit(errno);
+    }
+
+    arena->size = page_align(arena_size);
+    arena->refs = num_files;
+    arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(arena->base == MAP_FAILED) {
+        perror("Failed to allocate object file arena");
+        exit(errno);
+    }
+    ring->num_syscalls++;
+
+    uint8_t *buf = arena->base;
+    for(int i = 0; i < num_files; i++) {
+        load->bufs[i] = buf;
+        buf += align_to(load->stats[i].stx_size, 16);
+    }
+
+    for(;;) {
+        load->num_pending = 0;
+        for(int i = 0; i < num_files; i++) {
+            if(load->num_read[i] < load->stats[i].stx_size) {
+                load->pending[load->num_pending++] = i;
+            }
+        }
+
+        if(!load->num_pending) {
+            break;
+        }
+
+        uring_run(ring, load->num_pending, uring_prep_read, uring_done_read, load);
+    }
+
+    uring_run(ring, num_files, uring_prep_close, uring_done_close, load);
+
+    for(int i = 0; i < num_files; i++) {
+        objs[i] = load_obj_mem(load->bufs[i], load->stats[i].stx_size, load->files[i]);
+        objs[i]->source = SOURCE_ARENA;
+        objs[i]->arena = arena;
+    }
+
+    return 1;
+}
+
+// Loads the files a ring full at a time, so that no more than that many descriptors are open at once.
+// Returns the number of files loaded, the rest has to be loaded some other way if the kernel turned out
+// to lack the operations.
+static int load_objs_uring(struct uring *ring, const char **files, int num_files, struct object **objs) {
+    // The batch belongs to no single object, the detail says how many files it covers
+    char detail[32];
+    snprintf(detail, sizeof(detail), "%d files", num_files);
+
+    struct trace trace;
+    trace_start(&trace, PHASE_LOAD_OBJS_URING, NULL, detail);
+
+    // Every file takes two requests for open and statx
+    int batch_size = ring->entries / 2;
+    struct uring_load load = {
+        .fds = calloc(batch_size, sizeof(int)),
+        .stats = calloc(batch_size, sizeof(struct statx)),
+        .bufs = calloc(batch_size, sizeof(uint8_t *)),
+        .num_read = calloc(batch_size, sizeof(size_t)),
+        .pending = calloc(batch_size, sizeof(int)),
+    };
+    if(!load.fds || !load.stats || !load.bufs || !load.num_read || !load.pending) {
+        perror("Failed to allocate io_uring load state");
+        exit(errno);
+    }
+
+    int num_loaded = 0;
+    size_t num_bytes = 0;
+    while(num_loaded < num_files) {
+        int n = num_files - num_loaded < batch_size ? num_files - num_loaded : batch_size;
+
+        load.files = files + num_loaded;
+        if(!load_objs_uring_batch(ring, &load, n, objs + num_loaded)) {
+            break;
+        }
+
+        for(int i = 0; i < n; i++) {
+            num_bytes += load.stats[i].stx_size;
+        }
+        num_loaded += n;
+    }
+
+    free(load.fds);
+    free(load.stats);
+    free(load.bufs);
+    free(load.num_read);
+    free(load.pending);
+
+    trace_done(&trace, NULL, num_bytes, num_loaded);
+    return num_loaded;
+}
+
+// Loads many object files at once. LOAD_IO_URING falls back to LOAD_IO_POPULATE when io_uring
+// is not available, the mode which was actually used is returned.
+static enum load_io_mode load_objs(const char **files, int num_files, struct object **objs, enum load_io_mode mode) {
+    int num_loaded = 0;
+
+    if(mode == LOAD_IO_URING) {
+        struct uring ring;
+        int ok = !uring_init(&ring, 64);
+        if(ok) {
+            num_loaded = load_objs_uring(&ring, files, num_files, objs);
+            uring_exit(&ring);
+        }
+
+        // Shared by the whole batch, even a failed setup counts
+        add_process_syscalls(ring.num_syscalls);
+        if(ok && num_loaded == num_files) {
+            return LOAD_IO_URING;
+        }
+
+        mode = LOAD_IO_POPULATE;
+    }
+
+    for(int i = num_loaded; i < num_files; i++) {
+        objs[i] = open_obj(files[i], mode == LOAD_IO_POPULATE ? MAP_POPULATE : 0);
+    }
+
+    return mode;
+}
+
+// Drops the object file image. The symbols and strings tables are copied first, as they are
+// still needed to look functions up.
+static void release_obj_image(struct object *obj) {
+    if(!obj->base) {
+        return;
+    }
+
+    if(obj->symbols) {
+        size_t symbols_size = obj->num_symbols * sizeof(Elf64_Sym);
+        const Elf64_Shdr *strtab_hdr = lookup_section(obj, ".strtab");
+
+        obj->symbols_copy = malloc(symbols_size + strtab_hdr->sh_size);
+        if(!obj->symbols_copy) {
+            perror("Failed to allocate symbols table");
+            exit(errno);
+        }
+
+        memcpy(obj->symbols_copy, obj->symbols, symbols_size);
+        memcpy((uint8_t *)obj->symbols_copy + symbols_size, obj->strtab, strtab_hdr->sh_size);
+        obj->symbols = obj->symbols_copy;
+        obj->strtab = (const char *)obj->symbols_copy + symbols_size;
+    }
+
+    switch(obj->source) {
+        case SOURCE_BORROWED:
+            break;
+        case SOURCE_MAPPED:
+            munmap((void *)obj->base, obj->size);
+            obj->counters.num_syscalls++;
+            break;
+        case SOURCE_MALLOCED:
+            free((void *)obj->base);
+            break;
+        case SOURCE_ARENA:
+            if(!__atomic_sub_fetch(&obj->arena->refs, 1, __ATOMIC_ACQ_REL)) {
+                munmap(obj->arena->base, obj->arena->size);
+                obj->counters.num_syscalls++;
+                free(obj->arena);
+            }
+            obj->arena = NULL;
+            break;
+    }
+
+    obj->base = NULL;
+    obj->sections = NULL;
+    obj->shstrtab = NULL;
+}
+
+static uint8_t *section_runtime_base(struct object *obj, Elf64_Half section_idx) {
+    if(section_idx >= obj->num_sections || !obj->section_runtime_bases[section_idx]) {
+        const char *section_name = section_idx < obj->num_sections ? obj->shstrtab + obj->sections[section_idx].sh_name : "";
+        fprintf(stderr, "No runtime base address for section %s (%u)\n", section_name, section_idx);
+        exit(ENOENT);
+    }
+
+    return obj->section_runtime_bases[section_idx];
+}
+
+// Fills in a jumptable entry for the address and returns the entry
+static struct ext_jump *add_jump(struct object *obj, uint8_t *address) {
+    struct ext_jump *jump = &obj->jumptable[obj->num_jumps++];
+
+    jump->addr = address;
+
+    jump->instr[0] = 0xff;
+    jump->instr[1] = 0x25;
+    jump->instr[2] = 0xf2;
+    jump->instr[3] = 0xff;
+    jump->instr[4] = 0xff;
+    jump->instr[5] = 0xff;
+
+    return jump;
+}
+
+static void apply_relocation(struct object *obj, int type, int is_exec, uint8_t *patch_offset, uint8_t *symbol_address, int64_t addend) {
+    switch (type) {
+        case R_X86_64_64:    // S + A
+            *((uint64_t *)patch_offset) = (uint64_t)symbol_address + addend;
+            break;
+        case R_X86_64_32:    // S + A
+            if((uintptr_t)(symbol_address + addend) >> 32 > 0) {
+                if(!is_exec) {
+                    fprintf(stderr, "Absolute relocation in %s does not fit into 32 bits\n", obj->name);
+                    exit(ENOEXEC);
+                }
+
+                obj->trampoline_runtime_base[obj->num_trampolines].startaddr = &(obj->trampoline_runtime_base[obj->num_trampolines].data[0]);
+
+                uint8_t *instr_start_address = patch_offset - 1;
+                const uint64_t reloc_address = (uint64_t)(symbol_address + addend);
+                const uint8_t *tramp_offset = (uint8_t *)(obj->trampoline_runtime_base[obj->num_trampolines].startaddr - (instr_start_address + 5));
+                const uint32_t return_offset = (uint32_t)((instr_start_address + 5) - (obj->trampoline_runtime_base[obj->num_trampolines].startaddr + 15));
+                const uint8_t mov_opcode = *instr_start_address;
+
+                *instr_start_address = 0xE9;
+                *((uint32_t *)patch_offset) = (uint32_t)(uintptr_t)tramp_offset;
+
+                create_trampoline_func(&obj->trampoline_runtime_base[obj->num_trampolines], mov_opcode, reloc_address, return_offset);
+
+                obj->num_trampolines++;
+            } else {
+                *((uint32_t *)patch_offset) = (uint32_t)(uintptr_t)(symbol_address + addend);
+            }
+            break;
+        case R_X86_64_PLT32:        // L + A - P
+        case R_X86_64_PC32:         // S + A - P
+        case R_X86_64_GOTPCREL:     // G + GOT + A - P, symbol_address is the slot
+        case R_X86_64_GOTPCRELX:
+        case R_X86_64_REX_GOTPCRELX:
+            *((uint32_t *)patch_offset) = symbol_address + addend - patch_offset;
+            break;
+    }
+}
+
+// A tls_index for TLSGD and TLSLD takes the place of one jumptable entry
+_Static_assert(sizeof(struct tls_index) == sizeof(struct ext_jump), "tls_index must fit into a jumptable entry");
+
+static void do_tls_relocation(struct object *obj, int type, uint8_t *patch_offset, const Elf64_Sym *symbol, int64_t addend) {
+    if(!obj->tls_module || symbol->st_shndx >= obj->num_sections || !(obj->sections[symbol->st_shndx].sh_flags & SHF_TLS)) {
+        fprintf(stderr, "Thread local symbol %s is not defined in \"%s\"\n", obj->strtab + symbol->st_name, obj->name);
+        exit(ENOENT);
+    }
+
+    // Offset of the symbol in the object's TLS block
+    uint64_t offset = obj->tls_offsets[symbol->st_shndx] + symbol->st_value;
+    struct tls_index *index;
+    struct ext_jump *slot;
+
+    switch(type) {
+        case R_X86_64_TLSGD:     // GOT entry holding the tls_index of the symbol, relative
+        case R_X86_64_TLSLD:     // GOT entry holding the tls_index of the block, relative
+            index = (struct tls_index *)add_jump(obj, NULL);
+            index->module = obj->tls_module;
+            index->offset = type == R_X86_64_TLSGD ? offset : 0;
+            *((uint32_t *)patch_offset) = (uint8_t *)index + addend - patch_offset;
+            break;
+        case R_X86_64_DTPOFF32:  // offset in the block
+            *((uint32_t *)patch_offset) = offset + addend;
+            break;
+        case R_X86_64_DTPOFF64:
+            *((uint64_t *)patch_offset) = offset + addend;
+            break;
+        case R_X86_64_GOTTPOFF:  // GOT entry holding the offset from the thread pointer, relative
+            slot = add_jump(obj, (uint8_t *)(obj->tls_static_offset + offset));
+            *((uint32_t *)patch_offset) = (uint8_t *)&slot->addr + addend - patch_offset;
+            break;
+        case R_X86_64_TPOFF32:   // offset from the thread pointer
+            *((uint32_t *)patch_offset) = obj->tls_static_offset + offset + addend;
+            break;
+        case R_X86_64_TPOFF64:
+            *((uint64_t *)patch_offset) = obj->tls_static_offset + offset + addend;
+            break;
+    }
+}
+
+static void do_relocations(struct object *obj, const Elf64_Shdr *rela_hdr) {
+    // The section patched by these relocations is given by sh_info, the .rela.<name> naming is just a convention
+    const Elf64_Shdr *target_hdr = &obj->sections[rela_hdr->sh_info];
+    uint8_t *target_runtime_base = section_runtime_base(obj, rela_hdr->sh_info);
+    int is_exec = classify_section(obj, target_hdr) == SECTION_EXEC;
+
+    int num_relocations = rela_hdr->sh_size / rela_hdr->sh_entsize;
+    const Elf64_Rela *relocations = (Elf64_Rela *)(obj->base + rela_hdr->sh_offset);
+
+    struct trace trace;
+    trace_start(&trace, PHASE_RELOCATE, obj->name, obj->shstrtab + target_hdr->sh_name);
+
+    for(int i = 0; i < num_relocations; i++) {
+        int symbol_idx = ELF64_R_SYM(relocations[i].r_info);
+        int type = ELF64_R_TYPE(relocations[i].r_info);
+        const Elf64_Sym *symbol = &obj->symbols[symbol_idx];
+
+        if(type < R_X86_64_NUM) {
+            obj->counters.relocs_by_type[type]++;
+        }
+
+        uint8_t *patch_offset = target_runtime_base + relocations[i].r_offset;
+        uint8_t *symbol_address;
+
+        if(is_tls_relocation(type)) {
+            do_tls_relocation(obj, type, patch_offset, symbol, relocations[i].r_addend);
+            continue;
+        }
+
+        if(symbol_idx == 0) {
+            symbol_address = NULL;
+        } else if(symbol->st_shndx == SHN_UNDEF) {
+            symbol_address = lookup_ext_function(obj, obj->strtab + symbol->st_name);
+        } else if(symbol->st_shndx == SHN_ABS) {
+            symbol_address = (uint8_t *)symbol->st_value;
+        } else {
+            symbol_address = section_runtime_base(obj, symbol->st_shndx) + symbol->st_value;
+        }
+
+        // The resolvers may only run once the whole region is relocated and executable, see resolve_ifuncs
+        if(is_ifunc_relocation(obj, &relocations[i])) {
+            struct ifunc_reloc *deferred = &obj->deferred[obj->num_deferred++];
+
+            deferred->type = type;
+            deferred->is_exec = is_exec;
+            deferred->patch_offset = patch_offset;
+            deferred->resolver = symbol_address;
+            deferred->addend = relocations[i].r_addend;
+
+            if(is_got_relocation(type)) {
+                struct ext_jump *slot = add_jump(obj, NULL);
+
+                apply_relocation(obj, type, is_exec, patch_offset, (uint8_t *)&slot->addr, relocations[i].r_addend);
+
+                deferred->type = R_X86_64_64;
+                deferred->is_exec = 1;
+                deferred->patch_offset = (uint8_t *)&slot->addr;
+                deferred->addend = 0;
+            }
+            continue;
+        }
+
+        if(is_got_relocation(type)) {
+            symbol_address = (uint8_t *)&add_jump(obj, symbol_address)->addr;
+        } else if(symbol->st_shndx == SHN_UNDEF && symbol_idx != 0 && (is_exec || type != R_X86_64_64)) {
+            // Data can simply hold the full address, no need to go through the jumptable
+            symbol_address = add_jump(obj, symbol_address)->instr;
+        }
+
+        apply_relocation(obj, type, is_exec, patch_offset, symbol_address, relocations[i].r_addend);
+    }
+
+    trace_done(&trace, obj, target_hdr->sh_size, num_relocations);
+}
+
+// Runs the resolvers of the IFUNC symbols and applies the relocations held back for them. The code
+// group is briefly made writable again if any of them patches code.
+static void resolve_ifuncs(struct object **objs, int num_objs, struct runtime_region *region) {
+    int patch_exec = 0;
+
+    // All resolvers run before anything is made writable, they execute code of the region
+    for(int o = 0; o < num_objs; o++) {
+        for(int i = 0; i < objs[o]->num_deferred; i++) {
+            struct ifunc_reloc *deferred = &objs[o]->deferred[i];
+
+            // indirect (B + A), which ends up as an absolute address
+            if(deferred->type == R_X86_64_IRELATIVE) {
+                deferred->resolver += deferred->addend;
+                deferred->type = R_X86_64_64;
+                deferred->addend = 0;
+            }
+
+            deferred->resolver = ((uint8_t *(*)(void))deferred->resolver)();
+            patch_exec |= deferred->is_exec;
+        }
+    }
+
+    if(patch_exec && traced_mprotect(objs[0], region->base, region->class_size[SECTION_EXEC], PROT_READ | PROT_WRITE)) {
+        perror("Failed to make code writable");
+        exit(errno);
+    }
+
+    for(int o = 0; o < num_objs; o++) {
+        for(int i = 0; i < objs[o]->num_deferred; i++) {
+            struct ifunc_reloc *deferred = &objs[o]->deferred[i];
+            apply_relocation(objs[o], deferred->type, deferred->is_exec, deferred->patch_offset, deferred->resolver, deferred->addend);
+        }
+
+        free(objs[o]->deferred);
+        objs[o]->deferred = NULL;
+        objs[o]->num_deferred = 0;
+    }
+
+    if(patch_exec) {
+        if(traced_mprotect(objs[0], region->base, region->class_size[SECTION_EXEC], PROT_READ | PROT_EXEC)) {
+            perror("Failed to make code executable.");
+            exit(errno);
+        }
+        region->num_syscalls += 2;
+    }
+}
+
+// Counts the VMAs of this process overlapping [start, start + size)
+static int count_vmas(const uint8_t *start, size_t size) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if(!maps) {
+        perror("Failed to open /proc/self/maps");
+        exit(errno);
+    }
+
+    int num_vmas = 0;
+    uintptr_t vma_start, vma_end;
+    char line[512];
+    while(fgets(line, sizeof(line), maps)) {
+        if(sscanf(line, "%lx-%lx", &vma_start, &vma_end) != 2) {
+            continue;
+        }
+
+        if(vma_start < (uintptr_t)start + size && vma_end > (uintptr_t)start) {
+            num_vmas++;
+        }
+    }
+
+    fclose(maps);
+    return num_vmas;
+}
+
+// Leaves out every section the roots can't reach through relocations, like --gc-sections. Objects
+// built with -ffunction-sections and -fdata-sections can lose everything the caller does not use.
+// The relocations of the sections left out are never processed.
+static void strip_unreachable(struct object *obj) {
+    uint8_t *live = calloc(obj->num_sections, 1);
+    Elf64_Half *stack = calloc(obj->num_sections, sizeof(Elf64_Half));
+    Elf64_Half *relas = calloc(obj->num_sections, sizeof(Elf64_Half));
+    if(!live || !stack || !relas) {
+        perror("Failed to allocate section marks");
+        exit(errno);
+    }
+    int top = 0;
+
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        if(obj->sections[i].sh_type == SHT_RELA && obj->sections[i].sh_info < obj->num_sections) {
+            relas[obj->sections[i].sh_info] = i;
+        }
+
+        // Sections marked with __attribute__((retain)) stay no matter what
+        if(obj->sections[i].sh_flags & SHF_GNU_RETAIN) {
+            live[i] = 1;
+            stack[top++] = i;
+        }
+    }
+
+    for(int r = 0; r < obj->num_roots; r++) {
+        int found = 0;
+        for(int i = 0; i < obj->num_symbols && !found; i++) {
+            const Elf64_Sym *symbol = &obj->symbols[i];
+            if(symbol->st_shndx != SHN_UNDEF && symbol->st_shndx < obj->num_sections && ELF64_ST_BIND(symbol->st_info) != STB_LOCAL &&
+               !strcmp(obj->roots[r], obj->strtab + symbol->st_name)) {
+                found = 1;
+                if(!live[symbol->st_shndx]) {
+                    live[symbol->st_shndx] = 1;
+                    stack[top++] = symbol->st_shndx;
+                }
+            }
+        }
+
+        if(!found) {
+            fprintf(stderr, "Root %s is not defined in \"%s\"\n", obj->roots[r], obj->name);
+            exit(ENOENT);
+        }
+    }
+
+    while(top) {
+        Elf64_Half s = stack[--top];
+        if(!relas[s]) {
+            continue;
+        }
+
+        const Elf64_Shdr *rela_hdr = &obj->sections[relas[s]];
+        int num_relocations = rela_hdr->sh_size / rela_hdr->sh_entsize;
+        const Elf64_Rela *relocations = (Elf64_Rela *)(obj->base + rela_hdr->sh_offset);
+
+        for(int i = 0; i < num_relocations; i++) {
+            Elf64_Half target = obj->symbols[ELF64_R_SYM(relocations[i].r_info)].st_shndx;
+            if(target != SHN_UNDEF && target < obj->num_sections && !live[target]) {
+                live[target] = 1;
+                stack[top++] = target;
+            }
+        }
+    }
+
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        if(live[i] || classify_section(obj, &obj->sections[i]) == SECTION_SKIP) {
+            continue;
+        }
+
+        obj->stripped_bytes += obj->sections[i].sh_size;
+        if(relas[i]) {
+            obj->stripped_relocs += obj->sections[relas[i]].sh_size / obj->sections[relas[i]].sh_entsize;
+        }
+    }
+
+    obj->live_sections = live;
+    free(stack);
+    free(relas);
+}
+
+// Finds the sections and symbols tables and sizes the trampolines and the jumptable
+static void read_obj_tables(struct object *obj) {
+    struct trace trace;
+    trace_start(&trace, PHASE_SECTIONS, obj->name, NULL);
+
+    obj->sections = (const Elf64_Shdr *)(obj->base + obj->hdr->e_shoff);
+    obj->shstrtab = (const char*)(obj->base + obj->sections[obj->hdr->e_shstrndx].sh_offset);
+
+    const Elf64_Shdr *symtab_hdr = lookup_section(obj, ".symtab");
+    if(!symtab_hdr) {
+        fprintf(stderr, "Could not find \".symtab\" section\n");
+        exit(ENOEXEC);
+    }
+
+    obj->symbols = (const Elf64_Sym *)(obj->base + symtab_hdr->sh_offset);
+    obj->num_symbols = symtab_hdr->sh_size / symtab_hdr->sh_entsize;
+
+    const Elf64_Shdr *strtab_hdr = lookup_section(obj, ".strtab");
+    if(!strtab_hdr) {
+        fprintf(stderr, "Could not find \".strtab\" section\n");
+        exit(ENOEXEC);
+    }
+
+    obj->strtab = (const char *)(obj->base + strtab_hdr->sh_offset);
+
+    trace_done(&trace, obj, obj->num_sections * sizeof(Elf64_Shdr), obj->num_sections);
+
+    if(obj->roots) {
+        trace_start(&trace, PHASE_STRIP, obj->name, NULL);
+        strip_unreachable(obj);
+        trace_done(&trace, obj, obj->stripped_bytes, obj->stripped_relocs);
+    }
+
+    trace_start(&trace, PHASE_COUNT_RELOCS, obj->name, NULL);
+
+    count_external_symbols(obj);
+    count_absolute_relocations(obj);
+
+    trace_done(&trace, obj, 0, obj->num_ext_symbols + obj->num_absolute_relocs + obj->num_ifunc_relocs);
+
+    register_tls_module(obj);
+
+    obj->section_runtime_bases = calloc(obj->num_sections, sizeof(uint8_t *));
+    if(!obj->section_runtime_bases) {
+        perror("Failed to allocate section table");
+        exit(errno);
+    }
+
+    if(obj->num_ifunc_relocs) {
+        obj->deferred = calloc(obj->num_ifunc_relocs, sizeof(struct ifunc_reloc));
+        if(!obj->deferred) {
+            perror("Failed to allocate IFUNC relocations");
+            exit(errno);
+        }
+    }
+}
+
+// Call counts of functions, used to order code by hotness
+struct profile_entry {
+    char *name;
+    uint64_t count;
+};
+
+struct profile {
+    struct profile_entry *entries; // Sorted by name
+    size_t num_entries;
+};
+
+static int compare_profile_entries(const void *a, const void *b) {
+    return strcmp(((const struct profile_entry *)a)->name, ((const struct profile_entry *)b)->name);
+}
+
+// Reads a profile with a "<function> <count>" pair per line, lines starting with # are comments.
+// Functions which appear more than once have their counts summed up.
+static struct profile *load_profile(const char *file) {
+    FILE *f = fopen(file, "r");
+    if(!f) {
+        perror("Failed to open profile");
+        fprintf(stderr, "File \"%s\"\n", file);
+        exit(errno);
+    }
+
+    struct profile *profile = calloc(1, sizeof(struct profile));
+    size_t capacity = 0;
+    char line[512], name[256];
+    unsigned long long count;
+
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] == '#' || sscanf(line, "%255s %llu", name, &count) != 2) {
+            continue;
+        }
+
+        if(profile->num_entries == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            profile->entries = realloc(profile->entries, capacity * sizeof(struct profile_entry));
+            if(!profile->entries) {
+                perror("Failed to allocate profile");
+                exit(errno);
+            }
+        }
+
+        profile->entries[profile->num_entries].name = strdup(name);
+        profile->entries[profile->num_entries].count = count;
+        profile->num_entries++;
+    }
+
+    fclose(f);
+
+    qsort(profile->entries, profile->num_entries, sizeof(struct profile_entry), compare_profile_entries);
+
+    size_t num_unique = 0;
+    for(size_t i = 0; i < profile->num_entries; i++) {
+        if(num_unique && !strcmp(profile->entries[num_unique - 1].name, profile->entries[i].name)) {
+            profile->entries[num_unique - 1].count += profile->entries[i].count;
+            free(profile->entries[i].name);
+        } else {
+            profile->entries[num_unique++] = profile->entries[i];
+        }
+    }
+    profile->num_entries = num_unique;
+
+    return profile;
+}
+
+static void free_profile(struct profile *profile) {
+    for(size_t i = 0; i < profile->num_entries; i++) {
+        free(profile->entries[i].name);
+    }
+
+    free(profile->entries);
+    free(profile);
+}
+
+static uint64_t profile_count(const struct profile *profile, const char *name) {
+    struct profile_entry key = { .name = (char *)name };
+    const struct profile_entry *entry = bsearch(&key, profile->entries, profile->num_entries,
+                                                sizeof(struct profile_entry), compare_profile_entries);
+
+    return entry ? entry->count : 0;
+}
+
+// An executable section waiting to be placed, together with the call count of its hottest function
+struct exec_placement {
+    struct object *obj;
+    Elf64_Half section;
+    uint64_t count;
+    size_t order;
+};
+
+// Hot sections first, hottest to coldest, cold sections keep their original order
+static int compare_exec_placements(const void *a, const void *b) {
+    const struct exec_placement *pa = a, *pb = b;
+
+    if(pa->count != pb->count) {
+        return pa->count > pb->count ? -1 : 1;
+    }
+
+    return pa->order < pb->order ? -1 : pa->order > pb->order;
+}
+
+// Offsets of the loaded sections, trampolines and jumptables of a batch of objects within their groups
+struct layout {
+    uint64_t class_size[NUM_SECTION_CLASSES];
+    uint64_t **section_offsets;
+    uint64_t *trampoline_offsets;
+    uint64_t *jumptable_offsets;
+};
+
+// Lays a batch of objects out in three groups: code, read-only data and writable data. With a profile,
+// the functions which were called are packed at the start of the code group, hottest first and across
+// all the objects, and the functions which never were start on a page of their own after them.
+static void layout_objs(struct object **objs, int num_objs, const struct profile *profile, struct layout *layout) {
+    uint64_t *class_size = layout->class_size;
+    size_t num_exec = 0;
+
+    memset(class_size, 0, sizeof(layout->class_size));
+    layout->section_offsets = calloc(num_objs, sizeof(uint64_t *));
+    layout->trampoline_offsets = calloc(num_objs, sizeof(uint64_t));
+    layout->jumptable_offsets = calloc(num_objs, sizeof(uint64_t));
+    if(!layout->section_offsets || !layout->trampoline_offsets || !layout->jumptable_offsets) {
+        perror("Failed to allocate section layout");
+        exit(errno);
+    }
+
+    for(int o = 0; o < num_objs; o++) {
+        layout->section_offsets[o] = calloc(objs[o]->num_sections, sizeof(uint64_t));
+        if(!layout->section_offsets[o]) {
+            perror("Failed to allocate section layout");
+            exit(errno);
+        }
+
+        for(Elf64_Half i = 0; i < objs[o]->num_sections; i++) {
+            if(classify_section(objs[o], &objs[o]->sections[i]) == SECTION_EXEC) {
+                num_exec++;
+            }
+        }
+    }
+
+    // Executable sections of all the objects are placed together, so that hot code can be packed across objects
+    struct exec_placement *exec = calloc(num_exec ? num_exec : 1, sizeof(struct exec_placement));
+    if(!exec) {
+        perror("Failed to allocate section layout");
+        exit(errno);
+    }
+
+    num_exec = 0;
+    for(int o = 0; o < num_objs; o++) {
+        for(Elf64_Half i = 0; i < objs[o]->num_sections; i++) {
+            if(classify_section(objs[o], &objs[o]->sections[i]) == SECTION_EXEC) {
+                exec[num_exec].obj = objs[o];
+                exec[num_exec].section = i;
+                exec[num_exec].order = num_exec;
+                num_exec++;
+            }
+        }
+    }
+
+    if(profile) {
+        for(size_t e = 0; e < num_exec; e++) {
+            struct object *obj = exec[e].obj;
+            for(int i = 0; i < obj->num_symbols; i++) {
+                if(ELF64_ST_TYPE(obj->symbols[i].st_info) == STT_FUNC && obj->symbols[i].st_shndx == exec[e].section) {
+                    uint64_t count = profile_count(profile, obj->strtab + obj->symbols[i].st_name);
+                    if(count > exec[e].count) {
+                        exec[e].count = count;
+                    }
+                }
+            }
+        }
+
+        qsort(exec, num_exec, sizeof(struct exec_placement), compare_exec_placements);
+    }
+
+    for(size_t e = 0; e < num_exec; e++) {
+        const Elf64_Shdr *section = &exec[e].obj->sections[exec[e].section];
+        int o = 0;
+        while(objs[o] != exec[e].obj) {
+            o++;
+        }
+
+        // Cold code starts on a fresh page, so hot pages hold nothing but hot code
+        if(profile && e && exec[e - 1].count && !exec[e].count) {
+            class_size[SECTION_EXEC] = page_align(class_size[SECTION_EXEC]);
+        }
+
+        layout->section_offsets[o][exec[e].section] = align_to(class_size[SECTION_EXEC], section->sh_addralign);
+        class_size[SECTION_EXEC] = layout->section_offsets[o][exec[e].section] + section->sh_size;
+    }
+
+    free(exec);
+
+    // Trampolines and the jumptable hold code, so they go right after the executable sections
+    for(int o = 0; o < num_objs; o++) {
+        layout->trampoline_offsets[o] = align_to(class_size[SECTION_EXEC], sizeof(void *));
+        layout->jumptable_offsets[o] = align_to(layout->trampoline_offsets[o] + sizeof(Trampoline) * objs[o]->num_absolute_relocs, sizeof(void *));
+        class_size[SECTION_EXEC] = layout->jumptable_offsets[o] + sizeof(struct ext_jump) * objs[o]->num_ext_symbols;
+    }
+
+    // Place every other loaded section within its group, honouring the section alignment
+    for(int o = 0; o < num_objs; o++) {
+        for(Elf64_Half i = 0; i < objs[o]->num_sections; i++) {
+            enum section_class class = classify_section(objs[o], &objs[o]->sections[i]);
+            if(class == SECTION_SKIP || class == SECTION_EXEC) {
+                continue;
+            }
+
+            layout->section_offsets[o][i] = align_to(class_size[class], objs[o]->sections[i].sh_addralign);
+            class_size[class] = layout->section_offsets[o][i] + objs[o]->sections[i].sh_size;
+        }
+    }
+
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        class_size[class] = page_align(class_size[class]);
+    }
+}
+
+static void free_layout(struct layout *layout, int num_objs) {
+    for(int o = 0; o < num_objs; o++) {
+        free(layout->section_offsets[o]);
+    }
+
+    free(layout->section_offsets);
+    free(layout->trampoline_offsets);
+    free(layout->jumptable_offsets);
+}
+
+// Points object o of the layout at its place in the groups starting at class_base and copies its
+// sections there. Executable sections are only copied when copy_exec is set.
+static void place_obj(struct object *obj, uint8_t **class_base, const struct layout *layout, int o, int copy_exec) {
+    memcpy(obj->counters.region_used_before, obj->region->used_size, sizeof(obj->region->used_size));
+
+    obj->trampoline_runtime_base = (Trampoline *)(class_base[SECTION_EXEC] + layout->trampoline_offsets[o]);
+    obj->jumptable = (struct ext_jump *)(class_base[SECTION_EXEC] + layout->jumptable_offsets[o]);
+    obj->region->used_size[SECTION_EXEC] += sizeof(Trampoline) * obj->num_absolute_relocs + sizeof(struct ext_jump) * obj->num_ext_symbols;
+
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        enum section_class class = classify_section(obj, &obj->sections[i]);
+        if(class == SECTION_SKIP) {
+            continue;
+        }
+
+        obj->section_runtime_bases[i] = class_base[class] + layout->section_offsets[o][i];
+        obj->counters.section_bytes[class] += obj->sections[i].sh_size;
+        obj->region->used_size[class] += obj->sections[i].sh_size;
+
+        // .bss and friends take no space in the file, the anonymous mapping is already zeroed
+        if(obj->sections[i].sh_type != SHT_NOBITS && (copy_exec || class != SECTION_EXEC)) {
+            memcpy(obj->section_runtime_bases[i], obj->base + obj->sections[i].sh_offset, obj->sections[i].sh_size);
+        }
+    }
+
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        obj->counters.region_used[class] = obj->region->used_size[class] - obj->counters.region_used_before[class];
+    }
+}
+
+// Makes the code group executable, resolve_ifuncs needs it to run the resolvers
+static void protect_code(struct runtime_region *region, struct object *obj) {
+    if(region->class_size[SECTION_EXEC]) {
+        if(traced_mprotect(obj, region->base, region->class_size[SECTION_EXEC], PROT_READ | PROT_EXEC)) {
+            perror("Failed to make code executable.");
+            exit(errno);
+        }
+        region->num_syscalls++;
+    }
+}
+
+// Makes the read-only group read-only, only once resolve_ifuncs has patched the relocations held back in it
+static void protect_rodata(struct runtime_region *region, struct object *obj) {
+    if(region->class_size[SECTION_RODATA]) {
+        if(traced_mprotect(obj, region->base + region->class_size[SECTION_EXEC], region->class_size[SECTION_RODATA], PROT_READ)) {
+            perror("Failed to make read-only data readonly");
+            exit(errno);
+        }
+        region->num_syscalls++;
+    }
+}
+
+// Points the writable sections of an object at the same variables of obj->shared_data, so that two
+// builds of the same source share their state. Both have to be built with -fdata-sections, which gives
+// every variable a section of its own. Sections without a match keep their own copy. The relocations of
+// the shared sections are left out, applying them again would overwrite pointers the owner's code is
+// using concurrently.
+static void share_data_sections(struct object *obj) {
+    struct object *owner = obj->shared_data;
+
+    obj->shared_sections = calloc(obj->num_sections, 1);
+    if(!obj->shared_sections) {
+        perror("Failed to allocate shared sections");
+        exit(errno);
+    }
+
+    for(int i = 0; i < obj->num_symbols; i++) {
+        const Elf64_Sym *symbol = &obj->symbols[i];
+        if(ELF64_ST_TYPE(symbol->st_info) != STT_OBJECT || symbol->st_shndx >= obj->num_sections ||
+           classify_section(obj, &obj->sections[symbol->st_shndx]) != SECTION_DATA ||
+           symbol->st_value || symbol->st_size != obj->sections[symbol->st_shndx].sh_size) {
+            continue;
+        }
+
+        const char *name = obj->strtab + symbol->st_name;
+        for(int j = 0; j < owner->num_symbols; j++) {
+            const Elf64_Sym *owner_symbol = &owner->symbols[j];
+            if(ELF64_ST_TYPE(owner_symbol->st_info) == STT_OBJECT && owner_symbol->st_size == symbol->st_size &&
+               ELF64_ST_BIND(owner_symbol->st_info) == ELF64_ST_BIND(symbol->st_info) &&
+               owner_symbol->st_shndx < owner->num_sections && owner->section_runtime_bases[owner_symbol->st_shndx] &&
+               !strcmp(name, owner->strtab + owner_symbol->st_name)) {
+                obj->section_runtime_bases[symbol->st_shndx] = owner->section_runtime_bases[owner_symbol->st_shndx] + owner_symbol->st_value;
+                obj->shared_sections[symbol->st_shndx] = 1;
+                break;
+            }
+        }
+    }
+}
+
+// What loading costs, for one object or the whole process. The mapped and padding bytes, VMAs and the
+// syscalls setting up a region are split among the objects parsed into it by the bytes each uses, so
+// that the objects of a region add up to it. Padding is whatever a group holds beyond the sections,
+// trampolines and jumptables, i.e. section alignment and page_align. Phase times are only collected with
+// collect_phase_times set, and don't include the phases nested in them.
+struct load_stats {
+    int num_objects;
+    size_t section_bytes[NUM_SECTION_CLASSES];
+    size_t mapped_bytes[NUM_SECTION_CLASSES];
+    size_t padding_bytes[NUM_SECTION_CLASSES];
+    size_t num_trampolines;
+    size_t num_jumptable_slots;
+    uint64_t relocs_by_type[R_X86_64_NUM];
+    int num_vmas;
+    uint64_t num_syscalls;
+    uint64_t phase_ns[NUM_LOAD_PHASES];
+};
+
+// Parsed objects which are not unloaded yet, and what the unloaded ones cost
+static struct object *loaded_objects = NULL;
+static struct load_stats unloaded_stats;
+static unsigned stats_epoch = 0;
+static pthread_mutex_t loaded_objects_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void track_loaded_obj(struct object *obj) {
+    pthread_mutex_lock(&loaded_objects_lock);
+    obj->prev_loaded = NULL;
+    obj->next_loaded = loaded_objects;
+    if(loaded_objects) {
+        loaded_objects->prev_loaded = obj;
+    }
+    loaded_objects = obj;
+    pthread_mutex_unlock(&loaded_objects_lock);
+}
+
+// Adds what an object did while loading, which still counts for the process once it is unloaded
+static void add_obj_counters(struct load_stats *stats, const struct object *obj) {
+    for(int type = 0; type < R_X86_64_NUM; type++) {
+        stats->relocs_by_type[type] += obj->counters.relocs_by_type[type];
+    }
+
+    for(int phase = 0; phase < NUM_LOAD_PHASES; phase++) {
+        stats->phase_ns[phase] += obj->counters.phase_ns[phase];
+    }
+
+    stats->num_trampolines += obj->num_trampolines;
+    stats->num_jumptable_slots += obj->num_jumps;
+    stats->num_syscalls += obj->counters.num_syscalls;
+}
+
+static void add_section_bytes(struct load_stats *stats, const struct object *obj) {
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        stats->section_bytes[class] += obj->counters.section_bytes[class];
+    }
+}
+
+// Every non-empty group is mapped or protected on its own and ends up as one VMA
+static void add_region_stats(struct load_stats *stats, const struct runtime_region *region) {
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        stats->mapped_bytes[class] += region->class_size[class];
+        stats->padding_bytes[class] += region->class_size[class] - region->used_size[class];
+        stats->num_vmas += !!region->class_size[class];
+    }
+
+    stats->num_syscalls += region->num_syscalls;
+}
+
+static void untrack_loaded_obj(struct object *obj) {
+    pthread_mutex_lock(&loaded_objects_lock);
+    if(obj->prev_loaded) {
+        obj->prev_loaded->next_loaded = obj->next_loaded;
+    } else {
+        loaded_objects = obj->next_loaded;
+    }
+    if(obj->next_loaded) {
+        obj->next_loaded->prev_loaded = obj->prev_loaded;
+    }
+
+    add_obj_counters(&unloaded_stats, obj);
+    pthread_mutex_unlock(&loaded_objects_lock);
+}
+
+// Keeps the syscalls of a region which is about to be unmapped in the process stats
+static void retire_region_stats(const struct runtime_region *region) {
+    add_process_syscalls(region->num_syscalls + 1);
+}
+
+// Part of amount that falls to the used bytes following before out of total. The parts of all the
+// objects of a region add up to amount, rounding included.
+static size_t region_share(size_t amount, size_t before, size_t used, size_t total) {
+    return total ? amount * (before + used) / total - amount * before / total : 0;
+}
+
+// Adds the object's share of its region
+static void add_region_share(struct load_stats *stats, const struct object *obj) {
+    const struct runtime_region *region = obj->region;
+    size_t before = 0, used = 0, total = 0;
+
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        size_t class_before = obj->counters.region_used_before[class], class_used = obj->counters.region_used[class];
+
+        stats->mapped_bytes[class] += region_share(region->class_size[class], class_before, class_used, region->used_size[class]);
+        stats->padding_bytes[class] += region_share(region->class_size[class] - region->used_size[class], class_before,
+                                                    class_used, region->used_size[class]);
+        stats->num_vmas += region_share(!!region->class_size[class], class_before, class_used, region->used_size[class]);
+
+        before += class_before;
+        used += class_used;
+        total += region->used_size[class];
+    }
+
+    stats->num_syscalls += region_share(region->num_syscalls, before, used, total);
+}
+
+static void get_obj_stats(const struct object *obj, struct load_stats *stats) {
+    memset(stats, 0, sizeof(struct load_stats));
+    stats->num_objects = 1;
+
+    add_obj_counters(stats, obj);
+    add_section_bytes(stats, obj);
+    if(obj->region) {
+        add_region_share(stats, obj);
+    }
+}
+
+// Bytes, VMAs and the number of objects are those of the objects loaded now, the other counts include
+// the objects unloaded since the start
+static void get_process_stats(struct load_stats *stats) {
+    pthread_mutex_lock(&loaded_objects_lock);
+    *stats = unloaded_stats;
+    stats_epoch++;
+
+    for(int phase = 0; phase < NUM_LOAD_PHASES; phase++) {
+        stats->phase_ns[phase] += __atomic_load_n(&process_phase_ns[phase], __ATOMIC_RELAXED);
+    }
+    stats->num_syscalls += __atomic_load_n(&process_syscalls, __ATOMIC_RELAXED);
+
+    for(struct object *obj = loaded_objects; obj; obj = obj->next_loaded) {
+        stats->num_objects++;
+        add_obj_counters(stats, obj);
+        add_section_bytes(stats, obj);
+
+        if(obj->region->stats_epoch != stats_epoch) {
+            obj->region->stats_epoch = stats_epoch;
+            add_region_stats(stats, obj->region);
+        }
+    }
+    pthread_mutex_unlock(&loaded_objects_lock);
+}
+
+#define RELOC_NAME(type) [type] = #type
+
+static const char *reloc_names[R_X86_64_NUM] = {
+    RELOC_NAME(R_X86_64_64),
+    RELOC_NAME(R_X86_64_PC32),
+    RELOC_NAME(R_X86_64_PLT32),
+    RELOC_NAME(R_X86_64_32),
+    RELOC_NAME(R_X86_64_32S),
+    RELOC_NAME(R_X86_64_GOTPCREL),
+    RELOC_NAME(R_X86_64_TLSGD),
+    RELOC_NAME(R_X86_64_TLSLD),
+    RELOC_NAME(R_X86_64_DTPOFF32),
+    RELOC_NAME(R_X86_64_GOTTPOFF),
+    RELOC_NAME(R_X86_64_TPOFF32),
+    RELOC_NAME(R_X86_64_DTPOFF64),
+    RELOC_NAME(R_X86_64_TPOFF64),
+    RELOC_NAME(R_X86_64_PC64),
+    RELOC_NAME(R_X86_64_IRELATIVE),
+    RELOC_NAME(R_X86_64_GOTPCRELX),
+    RELOC_NAME(R_X86_64_REX_GOTPCRELX),
+};
+
+static void write_class_sizes_json(FILE *f, const char *key, const size_t *sizes) {
+    fprintf(f, ",\"%s\":{\"exec\":%zu,\"rodata\":%zu,\"data\":%zu}", key,
+            sizes[SECTION_EXEC], sizes[SECTION_RODATA], sizes[SECTION_DATA]);
+}
+
+// Writes the stats as one JSON object, name is null for the whole process
+static void write_stats_json(FILE *f, const char *name, const struct load_stats *stats) {
+    fputs("{\"name\":", f);
+    write_json_string(f, name);
+    fprintf(f, ",\"objects\":%d", stats->num_objects);
+    write_class_sizes_json(f, "section_bytes", stats->section_bytes);
+    write_class_sizes_json(f, "mapped_bytes", stats->mapped_bytes);
+    write_class_sizes_json(f, "padding_bytes", stats->padding_bytes);
+    fprintf(f, ",\"trampolines\":%zu,\"jumptable_slots\":%zu,\"vmas\":%d,\"syscalls\":%llu,\"relocations\":{",
+            stats->num_trampolines, stats->num_jumptable_slots, stats->num_vmas, (unsigned long long)stats->num_syscalls);
+
+    const char *sep = "";
+    for(int type = 0; type < R_X86_64_NUM; type++) {
+        if(!stats->relocs_by_type[type]) {
+            continue;
+        }
+
+        if(reloc_names[type]) {
+            fprintf(f, "%s\"%s\":%llu", sep, reloc_names[type], (unsigned long long)stats->relocs_by_type[type]);
+        } else {
+            fprintf(f, "%s\"type_%d\":%llu", sep, type, (unsigned long long)stats->relocs_by_type[type]);
+        }
+        sep = ",";
+    }
+
+    fputs("},\"phase_ns\":{", f);
+    for(int phase = 0; phase < NUM_LOAD_PHASES; phase++) {
+        fprintf(f, "%s\"%s\":%llu", phase ? "," : "", load_phase_names[phase], (unsigned long long)stats->phase_ns[phase]);
+    }
+    fputs("}}", f);
+}
+
+// Writes the process stats followed by those of every loaded object
+static void dump_load_stats(FILE *f) {
+    struct load_stats stats;
+    get_process_stats(&stats);
+
+    fputs("{\"process\":", f);
+    write_stats_json(f, NULL, &stats);
+    fputs(",\"objects\":[", f);
+
+    pthread_mutex_lock(&loaded_objects_lock);
+    for(struct object *obj = loaded_objects; obj; obj = obj->next_loaded) {
+        get_obj_stats(obj, &stats);
+        write_stats_json(f, obj->name, &stats);
+        if(obj->next_loaded) {
+            putc(',', f);
+        }
+    }
+    pthread_mutex_unlock(&loaded_objects_lock);
+
+    fputs("]}\n", f);
+}
+
+// Stats written at exit when LOADER_STATS names a file, or "-" for stderr
+static FILE *stats_file = NULL;
+
+static void dump_stats_at_exit(void) {
+    dump_load_stats(stats_file);
+    fflush(stats_file);
+}
+
+// Loads several objects into a single runtime region, so that they all share one mmap, one mprotect
+// per permission group and at most three VMAs. See layout_objs for how the profile is used.
+static void parse_objs(struct object **objs, int num_objs, const struct profile *profile) {
+    for(int o = 0; o < num_objs; o++) {
+        read_obj_tables(objs[o]);
+    }
+
+    struct layout layout;
+    layout_objs(objs, num_objs, profile, &layout);
+
+    struct runtime_region *region = calloc(1, sizeof(struct runtime_region));
+    if(!region) {
+        perror("Failed to allocate runtime region");
+        exit(errno);
+    }
+
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        region->class_size[class] = layout.class_size[class];
+        region->size += region->class_size[class];
+    }
+
+    region->base = mmap(NULL, region->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE
+                        |MAP_ANONYMOUS
+#ifdef MMAP_32
+                        | MAP_32BIT
+#endif
+                        , -1, 0);
+
+    if(region->base == MAP_FAILED) {
+        perror("Failed to allocate memory for the object sections.");
+        exit(errno);
+    }
+    region->num_syscalls++;
+    region->refs = num_objs;
+
+    uint8_t *class_base[NUM_SECTION_CLASSES];
+    class_base[SECTION_EXEC] = region->base;
+    class_base[SECTION_RODATA] = class_base[SECTION_EXEC] + region->class_size[SECTION_EXEC];
+    class_base[SECTION_DATA] = class_base[SECTION_RODATA] + region->class_size[SECTION_RODATA];
+
+    for(int o = 0; o < num_objs; o++) {
+        struct object *obj = objs[o];
+
+        obj->region = region;
+        place_obj(obj, class_base, &layout, o, 1);
+        if(obj->shared_data) {
+            share_data_sections(obj);
+        }
+
+        for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+            if(is_loaded_rela(obj, &obj->sections[i]) &&
+               !(obj->shared_sections && obj->shared_sections[obj->sections[i].sh_info])) {
+                do_relocations(obj, &obj->sections[i]);
+            }
+        }
+
+        release_obj_image(obj);
+    }
+
+    free_layout(&layout, num_objs);
+
+    protect_code(region, objs[0]);
+    resolve_ifuncs(objs, num_objs, region);
+    protect_rodata(region, objs[0]);
+
+    for(int o = 0; o < num_objs; o++) {
+        track_loaded_obj(objs[o]);
+    }
+}
+
+// Relocated code of an object, kept in a memfd so that every instance can map the same pages
+struct shared_text {
+    int memfd;
+    struct layout layout;
+};
+
+// Instances share their code, so it must come out of the relocations the same no matter where each
+// instance is mapped. That holds for relative relocations against the object itself or the jumptable.
+static void check_shareable(struct object *obj) {
+    for(Elf64_Half s = 0; s < obj->num_sections; s++) {
+        if(!is_loaded_rela(obj, &obj->sections[s])) {
+            continue;
+        }
+
+        int is_exec = classify_section(obj, &obj->sections[obj->sections[s].sh_info]) == SECTION_EXEC;
+        int num_relocations = obj->sections[s].sh_size / obj->sections[s].sh_entsize;
+        const Elf64_Rela *relocations = (Elf64_Rela *)(obj->base + obj->sections[s].sh_offset);
+
+        for(int i = 0; i < num_relocations; i++) {
+            int type = ELF64_R_TYPE(relocations[i].r_info);
+            int symbol_idx = ELF64_R_SYM(relocations[i].r_info);
+
+            // GOT slots of external symbols hold the same address in every instance
+            int is_ext_got = is_got_relocation(type) && obj->symbols[symbol_idx].st_shndx == SHN_UNDEF;
+
+            if(is_exec && type != R_X86_64_PC32 && type != R_X86_64_PLT32 && !is_ext_got) {
+                fprintf(stderr, "\"%s\" has absolute relocations in its code, instances can't share it\n", obj->name);
+                exit(ENOEXEC);
+            }
+
+            // Would need a jumptable entry, but the jumptable belongs to the shared code
+            if(!is_exec && type != R_X86_64_64 && obj->symbols[symbol_idx].st_shndx == SHN_UNDEF) {
+                fprintf(stderr, "\"%s\" has relative relocations to external symbols in its data, instances can't share it\n", obj->name);
+                exit(ENOEXEC);
+            }
+        }
+    }
+}
+
+// Creates a new instance of an object which has been loaded, but not parsed. The code is relocated once
+// into a memfd and every instance maps those same physical pages, followed by its private copy of the
+// read-only and writable data, so PC-relative references resolve to the instance's own data.
+// The template keeps its object file image until it is unloaded itself.
+static struct object *instantiate_obj(struct object *tmpl) {
+    struct object *inst = load_obj_mem(tmpl->base, tmpl->size, tmpl->name);
+    read_obj_tables(inst);
+
+    int first = !tmpl->shared_text;
+    if(first) {
+        check_shareable(inst);
+
+        tmpl->shared_text = calloc(1, sizeof(struct shared_text));
+        if(!tmpl->shared_text) {
+            perror("Failed to allocate shared text");
+            exit(errno);
+        }
+
+        layout_objs(&inst, 1, NULL, &tmpl->shared_text->layout);
+
+        // Kernels with vm.memfd_noexec need to be told up front that the memfd will be executed
+#ifdef MFD_EXEC
+        tmpl->shared_text->memfd = memfd_create(tmpl->name, MFD_CLOEXEC | MFD_EXEC);
+        if(tmpl->shared_text->memfd < 0 && errno == EINVAL)
+#endif
+        tmpl->shared_text->memfd = memfd_create(tmpl->name, MFD_CLOEXEC);
+
+        if(tmpl->shared_text->memfd < 0 ||
+           ftruncate(tmpl->shared_text->memfd, tmpl->shared_text->layout.class_size[SECTION_EXEC])) {
+            perror("Failed to create memfd for shared text");
+            exit(errno);
+        }
+    }
+
+    const struct layout *layout = &tmpl->shared_text->layout;
+    struct runtime_region *region = calloc(1, sizeof(struct runtime_region));
+    if(!region) {
+        perror("Failed to allocate runtime region");
+        exit(errno);
+    }
+
+    for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+        region->class_size[class] = layout->class_size[class];
+        region->size += region->class_size[class];
+    }
+
+    region->base = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region->base == MAP_FAILED) {
+        perror("Failed to allocate memory for the object sections.");
+        exit(errno);
+    }
+    region->num_syscalls++;
+    region->refs = 1;
+
+    // The first instance writes the relocated code through its mapping, the others only execute it
+    if(region->class_size[SECTION_EXEC]) {
+        if(mmap(region->base, region->class_size[SECTION_EXEC], first ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC,
+                MAP_SHARED | MAP_FIXED, tmpl->shared_text->memfd, 0) == MAP_FAILED) {
+            perror("Failed to map shared text");
+            exit(errno);
+        }
+        region->num_syscalls++;
+    }
+
+    uint8_t *class_base[NUM_SECTION_CLASSES];
+    class_base[SECTION_EXEC] = region->base;
+    class_base[SECTION_RODATA] = class_base[SECTION_EXEC] + region->class_size[SECTION_EXEC];
+    class_base[SECTION_DATA] = class_base[SECTION_RODATA] + region->class_size[SECTION_RODATA];
+
+    inst->region = region;
+    place_obj(inst, class_base, layout, 0, first);
+
+    for(Elf64_Half i = 0; i < inst->num_sections; i++) {
+        if(is_loaded_rela(inst, &inst->sections[i]) &&
+           (first || classify_section(inst, &inst->sections[inst->sections[i].sh_info]) != SECTION_EXEC)) {
+            do_relocations(inst, &inst->sections[i]);
+        }
+    }
+
+    release_obj_image(inst);
+
+    // Later instances map the code executable right away
+    if(first) {
+        protect_code(region, inst);
+    }
+    resolve_ifuncs(&inst, 1, region);
+    protect_rodata(region, inst);
+    track_loaded_obj(inst);
+
+    return inst;
+}
+
+static void parse_obj(struct object *obj) {
+    parse_objs(&obj, 1, NULL);
+}
+
+// Compiler used by compile_obj and the directory its objects are cached in, overridden by the CC
+// and LOADER_CACHE_DIR environment variables in main
+static const char *compiler = "cc";
+static const char *compile_cache_dir = "bin/cache";
+
+// Latency of compile_obj, in nanoseconds
+struct compile_metrics {
+    uint64_t num_requests;
+    uint64_t num_cache_hits;
+    uint64_t compile_ns; // cc runs, cache misses only
+    uint64_t load_ns;    // loading and parsing, hits and misses
+    uint64_t max_compile_ns;
+    uint64_t max_load_ns;
+};
+
+static struct compile_metrics compile_metrics;
+
+static void add_metric(uint64_t *total, uint64_t *max, uint64_t ns) {
+    __atomic_fetch_add(total, ns, __ATOMIC_RELAXED);
+
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while(ns > old && !__atomic_compare_exchange_n(max, &old, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Everything the compiled object depends on, the cache is keyed by its hash. It is stored next to the
+// cached object so that a hash collision is caught instead of loading the wrong code.
+static char *compile_key(const char *source, const char *flags, size_t *size) {
+    *size = strlen(compiler) + 1 + strlen(flags) + 1 + strlen(source);
+
+    char *key = malloc(*size + 1);
+    if(!key) {
+        perror("Failed to allocate compile key");
+        exit(errno);
+    }
+    sprintf(key, "%s\n%s\n%s", compiler, flags, source);
+
+    return key;
+}
+
+static uint64_t hash_bytes(const char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static int cache_key_matches(const char *key_path, const char *key, size_t key_size) {
+    int fd = open(key_path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    int matches = 0;
+    if(!fstat(fd, &st) && (size_t)st.st_size == key_size) {
+        char *cached = malloc(key_size);
+        matches = cached && read(fd, cached, key_size) == (ssize_t)key_size && !memcmp(cached, key, key_size);
+        free(cached);
+    }
+
+    close(fd);
+    return matches;
+}
+
+// Writes a file through a temporary one, so that concurrent readers see it whole or not at all
+static void write_file_atomic(const char *path, const void *data, size_t size) {
+    // Every writer gets a file of its own, threads of one process may be writing the same key
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if(fd < 0 || fchmod(fd, 0644)) {
+        perror("Failed to create cache file");
+        fprintf(stderr, "File \"%s\"\n", tmp_path);
+        exit(errno);
+    }
+
+    const uint8_t *p = data;
+    while(size) {
+        ssize_t written = write(fd, p, size);
+        if(written < 0) {
+            perror("Failed to write cache file");
+            exit(errno);
+        }
+        p += written;
+        size -= written;
+    }
+
+    close(fd);
+
+    if(rename(tmp_path, path)) {
+        perror("Failed to rename cache file");
+        exit(errno);
+    }
+}
+
+// Runs "cc <flags> -c -x c <source> -o <object>" with both files passed as memfds. The flags are split on
+// whitespace, quoting is not supported.
+static int run_compiler(int source_fd, int object_fd, const char *flags) {
+    char source_path[64], object_path[64];
+    snprintf(source_path, sizeof(source_path), "/proc/self/fd/%d", source_fd);
+    snprintf(object_path, sizeof(object_path), "/proc/self/fd/%d", object_fd);
+
+    char *flags_copy = strdup(flags);
+    int max_args = strlen(flags) / 2 + 8;
+    char **argv = calloc(max_args + 1, sizeof(char *));
+    if(!flags_copy || !argv) {
+        perror("Failed to allocate compiler arguments");
+        exit(errno);
+    }
+
+    int argc = 0;
+    argv[argc++] = (char *)compiler;
+    for(char *saveptr, *flag = strtok_r(flags_copy, " \t\n", &saveptr); flag; flag = strtok_r(NULL, " \t\n", &saveptr)) {
+        argv[argc++] = flag;
+    }
+    argv[argc++] = "-c";
+    argv[argc++] = "-x";
+    argv[argc++] = "c";
+    argv[argc++] = source_path;
+    argv[argc++] = "-o";
+    argv[argc++] = object_path;
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("Failed to start compiler");
+        exit(errno);
+    }
+
+    if(!pid) {
+        execvp(compiler, argv);
+        perror("Failed to run compiler");
+        _exit(127);
+    }
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+    free(argv);
+    free(flags_copy);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Compiles C source with the given flags into a memfd, without a link step, then loads and parses the
+// object. Objects are cached under compile_cache_dir by the hash of the compiler, flags and source,
+// so compiling the same source again only loads the cached object. Returns NULL if cc fails, its
+// diagnostics go to stderr. With shared_data set, the object uses its data, see share_data_sections.
+static struct object *compile_obj_shared(const char *source, const char *flags, struct object *shared_data) {
+    __atomic_fetch_add(&compile_metrics.num_requests, 1, __ATOMIC_RELAXED);
+
+    size_t key_size;
+    char *key = compile_key(source, flags, &key_size);
+
+    char object_path[512], key_path[516];
+    snprintf(object_path, sizeof(object_path), "%s/%016llx.o", compile_cache_dir, (unsigned long long)hash_bytes(key, key_size));
+    snprintf(key_path, sizeof(key_path), "%s.key", object_path);
+
+    uint64_t start = now_ns();
+    struct object *obj = NULL;
+
+    if(cache_key_matches(key_path, key, key_size)) {
+        int fd = open(object_path, O_RDONLY | O_CLOEXEC);
+        if(fd >= 0) {
+            obj = load_obj_fd(fd, object_path);
+            close(fd);
+            __atomic_fetch_add(&compile_metrics.num_cache_hits, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if(!obj) {
+        int source_fd = memfd_create("source.c", MFD_CLOEXEC);
+        int object_fd = memfd_create(object_path, MFD_CLOEXEC);
+        if(source_fd < 0 || object_fd < 0) {
+            perror("Failed to create memfd for compiling");
+            exit(errno);
+        }
+
+        if(write(source_fd, source, strlen(source)) != (ssize_t)strlen(source)) {
+            perror("Failed to write source");
+            exit(errno);
+        }
+
+        // The compiler only inherits the two memfds it needs
+        fcntl(source_fd, F_SETFD, 0);
+        fcntl(object_fd, F_SETFD, 0);
+
+        int status = run_compiler(source_fd, object_fd, flags);
+        close(source_fd);
+
+        uint64_t compiled = now_ns();
+        add_metric(&compile_metrics.compile_ns, &compile_metrics.max_compile_ns, compiled - start);
+        start = compiled;
+
+        if(status) {
+            fprintf(stderr, "Compiler exited with status %d\n", status);
+            close(object_fd);
+            free(key);
+            return NULL;
+        }
+
+        obj = load_obj_fd(object_fd, object_path);
+        close(object_fd);
+
+        // Objects are cached before parsing, which releases the image
+        if(mkdir(compile_cache_dir, 0755) && errno != EEXIST) {
+            perror("Failed to create compile cache");
+            exit(errno);
+        }
+        write_file_atomic(object_path, obj->base, obj->size);
+        write_file_atomic(key_path, key, key_size);
+    }
+
+    free(key);
+
+    obj->shared_data = shared_data;
+    parse_obj(obj);
+
+    add_metric(&compile_metrics.load_ns, &compile_metrics.max_load_ns, now_ns() - start);
+
+    return obj;
+}
+
+static struct object *compile_obj(const char *source, const char *flags) {
+    return compile_obj_shared(source, flags, NULL);
+}
+
+// How often the tiering thread looks at the call counts. It backs off up to the maximum while no
+// tiered function is called.
+#define TIER_POLL_NS 1000000
+#define TIER_MAX_POLL_NS 64000000
+
+// Tiered objects which still have functions to promote. A single thread watches all of them and
+// exits once the list is empty, the next compile_tiered starts it again.
+static struct tiering *tiered_objects = NULL;
+static int tiering_running = 0;
+static pthread_mutex_t tiering_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Promotes every function of a tiered object that crossed the threshold. The optimized build is
+// compiled the first time any function gets hot. Returns the sum of the call counts.
+static uint64_t promote_hot_functions(struct tiering *tiering) {
+    uint64_t total_calls = 0;
+
+    for(int i = 0; i < tiering->num_functions && !tiering->failed; i++) {
+        struct tiered_function *function = &tiering->functions[i];
+        uint64_t calls = __atomic_load_n(&tiering->slots[i].calls, __ATOMIC_RELAXED);
+        total_calls += calls;
+        if(function->promoted || calls < tiering->threshold) {
+            continue;
+        }
+
+        if(!tiering->optimized) {
+            char flags[512];
+            snprintf(flags, sizeof(flags), "-O3 -fdata-sections %s", tiering->flags);
+
+            tiering->optimized = compile_obj_shared(tiering->source, flags, tiering->obj);
+            if(!tiering->optimized) {
+                fprintf(stderr, "Failed to compile optimized tier of %s, staying on the baseline\n", tiering->obj->name);
+                tiering->failed = 1;
+                break;
+            }
+        }
+
+        uint8_t *target = lookup_function(tiering->optimized, function->name);
+        if(target) {
+            __atomic_store_n(&tiering->slots[i].target, target, __ATOMIC_RELEASE);
+        }
+        function->promoted = 1;
+        __atomic_fetch_add(&tiering->num_promoted, 1, __ATOMIC_RELEASE);
+    }
+
+    return total_calls;
+}
+
+// Background thread shared by all tiered objects. Objects are dropped from the list once they are
+// fully promoted or their optimized build failed.
+static void *tiering_thread(void *arg) {
+    (void)arg;
+    uint64_t poll_ns = TIER_POLL_NS, last_calls = 0;
+
+    pthread_mutex_lock(&tiering_lock);
+    while(tiered_objects) {
+        pthread_mutex_unlock(&tiering_lock);
+        struct timespec poll = { poll_ns / 1000000000, poll_ns % 1000000000 };
+        nanosleep(&poll, NULL);
+        pthread_mutex_lock(&tiering_lock);
+
+        uint64_t calls = 0;
+        for(struct tiering **tiering = &tiered_objects; *tiering;) {
+            calls += promote_hot_functions(*tiering);
+            if((*tiering)->failed || (*tiering)->num_promoted == (*tiering)->num_functions) {
+                *tiering = (*tiering)->next;
+            } else {
+                tiering = &(*tiering)->next;
+            }
+        }
+
+        poll_ns = calls != last_calls ? TIER_POLL_NS : poll_ns * 2 < TIER_MAX_POLL_NS ? poll_ns * 2 : TIER_MAX_POLL_NS;
+        last_calls = calls;
+    }
+
+    tiering_running = 0;
+    pthread_mutex_unlock(&tiering_lock);
+
+    return NULL;
+}
+
+// Compiles C source quickly at -O0 and returns the loaded object. Its global functions are counted
+// through stubs, and once one is called threshold times, the source is compiled again at -O3 in the
+// background. The function's stub then jumps to the optimized build. Pointers from lookup_function
+// are the stubs, so callers pick up the faster code without looking the function up again. Both
+// builds share the writable data of the baseline.
+static struct object *compile_tiered(const char *source, const char *flags, uint64_t threshold) {
+    char baseline_flags[512];
+    snprintf(baseline_flags, sizeof(baseline_flags), "-O0 -fdata-sections %s", flags);
+
+    struct object *obj = compile_obj(source, baseline_flags);
+    if(!obj) {
+        return NULL;
+    }
+
+    struct tiering *tiering = calloc(1, sizeof(struct tiering));
+    if(!tiering) {
+        perror("Failed to allocate tiering");
+        exit(errno);
+    }
+    tiering->source = strdup(source);
+    tiering->flags = strdup(flags);
+    tiering->threshold = threshold;
+
+    for(int i = 0; i < obj->num_symbols; i++) {
+        int bind = ELF64_ST_BIND(obj->symbols[i].st_info);
+        if(ELF64_ST_TYPE(obj->symbols[i].st_info) == STT_FUNC && (bind == STB_GLOBAL || bind == STB_WEAK) &&
+           obj->symbols[i].st_shndx < obj->num_sections && obj->section_runtime_bases[obj->symbols[i].st_shndx]) {
+            tiering->num_functions++;
+        }
+    }
+
+    tiering->functions = calloc(tiering->num_functions, sizeof(struct tiered_function));
+    size_t stubs_size = page_align(tiering->num_functions * TIER_STUB_SIZE);
+    tiering->size = stubs_size + page_align(tiering->num_functions * sizeof(struct tier_slot));
+    tiering->stubs = mmap(NULL, tiering->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(!tiering->functions || !tiering->source || !tiering->flags || tiering->stubs == MAP_FAILED) {
+        perror("Failed to allocate tiering stubs");
+        exit(errno);
+    }
+    tiering->slots = (struct tier_slot *)(tiering->stubs + stubs_size);
+
+    int f = 0;
+    for(int i = 0; i < obj->num_symbols; i++) {
+        int bind = ELF64_ST_BIND(obj->symbols[i].st_info);
+        if(ELF64_ST_TYPE(obj->symbols[i].st_info) != STT_FUNC || (bind != STB_GLOBAL && bind != STB_WEAK) ||
+           obj->symbols[i].st_shndx >= obj->num_sections || !obj->section_runtime_bases[obj->symbols[i].st_shndx]) {
+            continue;
+        }
+
+        uint8_t *stub = tiering->stubs + f * TIER_STUB_SIZE;
+        tiering->functions[f].name = obj->strtab + obj->symbols[i].st_name;
+        tiering->slots[f].target = obj->section_runtime_bases[obj->symbols[i].st_shndx] + obj->symbols[i].st_value;
+
+        // incq calls(%rip)
+        stub[0] = 0x48;
+        stub[1] = 0xff;
+        stub[2] = 0x05;
+        *((uint32_t *)&stub[3]) = (uint8_t *)&tiering->slots[f].calls - (stub + 7);
+
+        // jmp *target(%rip)
+        stub[7] = 0xff;
+        stub[8] = 0x25;
+        *((uint32_t *)&stub[9]) = (uint8_t *)&tiering->slots[f].target - (stub + 13);
+
+        memset(stub + 13, 0xcc, TIER_STUB_SIZE - 13);
+        f++;
+    }
+
+    if(traced_mprotect(obj, tiering->stubs, stubs_size, PROT_READ | PROT_EXEC)) {
+        perror("Failed to make tiering stubs executable");
+        exit(errno);
+    }
+    obj->counters.num_syscalls += 2;
+
+    obj->tiering = tiering;
+    tiering->obj = obj;
+
+    pthread_mutex_lock(&tiering_lock);
+
+    tiering->next = tiered_objects;
+    tiered_objects = tiering;
+
+    if(!tiering_running) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        int err = pthread_create(&thread, &attr, tiering_thread, NULL);
+        if(err) {
+            errno = err;
+            perror("Failed to start tiering thread");
+            exit(errno);
+        }
+        pthread_attr_destroy(&attr);
+        tiering_running = 1;
+    }
+
+    pthread_mutex_unlock(&tiering_lock);
+
+    return obj;
+}
+
+// Stops promoting the functions of a tiered object, the optimized build stays loaded. Once this
+// returns the tiering thread no longer touches the object.
+static void stop_tiering(struct tiering *tiering) {
+    pthread_mutex_lock(&tiering_lock);
+
+    for(struct tiering **watched = &tiered_objects; *watched; watched = &(*watched)->next) {
+        if(*watched == tiering) {
+            *watched = tiering->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&tiering_lock);
+}
+
+// Background loading. Loads are queued on an executor and picked up by a fixed number of workers, which
+// caps how many run at once. The object of a handle becomes available once it is relocated and
+// protected, the caller can poll, wait or register a callback for that.
+enum load_state {
+    LOAD_PENDING,
+    LOAD_RUNNING,
+    LOAD_DONE,
+    LOAD_CANCELLED,
+    LOAD_FAILED, // the file could not be read or is no valid object, see load_error
+};
+
+struct load_handle;
+
+// Called once per handle, on the worker when the load finishes or on the thread which cancelled it or
+// registered the callback too late. obj is NULL for cancelled and failed loads.
+typedef void (*load_callback)(struct load_handle *handle, struct object *obj, void *arg);
+
+struct load_handle {
+    struct load_executor *executor;
+    char *file;
+    enum load_state state;
+    struct object *obj;
+    int error;
+
+    load_callback callback;
+    void *callback_arg;
+
+    struct load_handle *next;
+};
+
+struct load_executor {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+
+    // Pending loads, oldest first
+    struct load_handle *head;
+    struct load_handle *tail;
+
+    pthread_t *workers;
+    int num_workers;
+    int stop;
+};
+
+static void *load_worker(void *arg) {
+    struct load_executor *executor = arg;
+
+    pthread_mutex_lock(&executor->lock);
+    for(;;) {
+        while(!executor->head && !executor->stop) {
+            pthread_cond_wait(&executor->queued, &executor->lock);
+        }
+
+        if(!executor->head) {
+            break;
+        }
+
+        struct load_handle *handle = executor->head;
+        executor->head = handle->next;
+        if(!executor->head) {
+            executor->tail = NULL;
+        }
+        handle->state = LOAD_RUNNING;
+
+        pthread_mutex_unlock(&executor->lock);
+
+        // A bad file fails its load instead of taking the process down, errors while relocating still exit
+        int error = 0;
+        struct object *obj = try_open_obj(handle->file, 0, &error);
+        if(obj) {
+            parse_obj(obj);
+        }
+
+        // The callback runs before the handle is done, so waiters may free it as soon as they return
+        pthread_mutex_lock(&executor->lock);
+        handle->obj = obj;
+        handle->error = error;
+        load_callback callback = handle->callback;
+        pthread_mutex_unlock(&executor->lock);
+
+        if(callback) {
+            callback(handle, obj, handle->callback_arg);
+        }
+
+        pthread_mutex_lock(&executor->lock);
+        __atomic_store_n(&handle->state, obj ? LOAD_DONE : LOAD_FAILED, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&executor->finished);
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    return NULL;
+}
+
+// Starts an executor which runs at most max_concurrent loads at a time
+static struct load_executor *create_load_executor(int max_concurrent) {
+    struct load_executor *executor = calloc(1, sizeof(struct load_executor));
+    if(!executor) {
+        perror("Failed to allocate load executor");
+        exit(errno);
+    }
+
+    pthread_mutex_init(&executor->lock, NULL);
+    pthread_cond_init(&executor->queued, NULL);
+    pthread_cond_init(&executor->finished, NULL);
+
+    executor->workers = calloc(max_concurrent, sizeof(pthread_t));
+    if(!executor->workers) {
+        perror("Failed to allocate load workers");
+        exit(errno);
+    }
+
+    for(; executor->num_workers < max_concurrent; executor->num_workers++) {
+        int err = pthread_create(&executor->workers[executor->num_workers], NULL, load_worker, executor);
+        if(err) {
+            errno = err;
+            perror("Failed to start load worker");
+            exit(errno);
+        }
+    }
+
+    return executor;
+}
+
+// Queues loading and parsing an object file. Files which can't be opened, read or are no valid objects
+// fail the load, see load_error. Errors while relocating exit the process like the synchronous loads.
+static struct load_handle *load_obj_async(struct load_executor *executor, const char *file) {
+    struct load_handle *handle = calloc(1, sizeof(struct load_handle));
+    if(!handle || !(handle->file = strdup(file))) {
+        perror("Failed to allocate load handle");
+        exit(errno);
+    }
+    handle->executor = executor;
+
+    pthread_mutex_lock(&executor->lock);
+    if(executor->tail) {
+        executor->tail->next = handle;
+    } else {
+        executor->head = handle;
+    }
+    executor->tail = handle;
+    pthread_cond_signal(&executor->queued);
+    pthread_mutex_unlock(&executor->lock);
+
+    return handle;
+}
+
+static enum load_state poll_load(struct load_handle *handle) {
+    return __atomic_load_n(&handle->state, __ATOMIC_ACQUIRE);
+}
+
+static int is_load_finished(enum load_state state) {
+    return state == LOAD_DONE || state == LOAD_CANCELLED || state == LOAD_FAILED;
+}
+
+// Returns the loaded object, or NULL if the load was cancelled or failed
+static struct object *wait_load(struct load_handle *handle) {
+    struct load_executor *executor = handle->executor;
+
+    // Finished handles may outlive their executor
+    if(is_load_finished(poll_load(handle))) {
+        return handle->obj;
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    while(!is_load_finished(handle->state)) {
+        pthread_cond_wait(&executor->finished, &executor->lock);
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    return handle->obj;
+}
+
+// Runs the callback when the load finishes, or right away if it already has
+static void on_load(struct load_handle *handle, load_callback callback, void *arg) {
+    struct load_executor *executor = handle->executor;
+
+    pthread_mutex_lock(&executor->lock);
+    int finished = handle->obj || handle->error || handle->state == LOAD_CANCELLED;
+    if(!finished) {
+        handle->callback = callback;
+        handle->callback_arg = arg;
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    if(finished) {
+        callback(handle, handle->obj, arg);
+    }
+}
+
+// Waits for the load and returns the errno it failed with, 0 if it did not fail
+static int load_error(struct load_handle *handle) {
+    wait_load(handle);
+    return handle->error;
+}
+
+// Cancels a load which has not started yet. Returns 0 if it is already running or done.
+static int cancel_load(struct load_handle *handle) {
+    struct load_executor *executor = handle->executor;
+
+    pthread_mutex_lock(&executor->lock);
+    if(handle->state != LOAD_PENDING) {
+        pthread_mutex_unlock(&executor->lock);
+        return 0;
+    }
+
+    struct load_handle **link = &executor->head, *prev = NULL;
+    while(*link != handle) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = handle->next;
+    if(executor->tail == handle) {
+        executor->tail = prev;
+    }
+
+    __atomic_store_n(&handle->state, LOAD_CANCELLED, __ATOMIC_RELEASE);
+    load_callback callback = handle->callback;
+    pthread_cond_broadcast(&executor->finished);
+    pthread_mutex_unlock(&executor->lock);
+
+    if(callback) {
+        callback(handle, NULL, handle->callback_arg);
+    }
+
+    return 1;
+}
+
+// Frees a handle once its load is done or cancelled, the object belongs to the caller
+static void free_load_handle(struct load_handle *handle) {
+    wait_load(handle);
+    free(handle->file);
+    free(handle);
+}
+
+// Cancels the pending loads, waits for the running ones and stops the workers. Handles stay valid
+// until they are freed.
+static void destroy_load_executor(struct load_executor *executor) {
+    struct load_handle *pending;
+
+    pthread_mutex_lock(&executor->lock);
+    while((pending = executor->head)) {
+        pthread_mutex_unlock(&executor->lock);
+        cancel_load(pending);
+        pthread_mutex_lock(&executor->lock);
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    pthread_mutex_lock(&executor->lock);
+    executor->stop = 1;
+    pthread_cond_broadcast(&executor->queued);
+    pthread_mutex_unlock(&executor->lock);
+
+    for(int i = 0; i < executor->num_workers; i++) {
+        pthread_join(executor->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&executor->queued);
+    pthread_cond_destroy(&executor->finished);
+    pthread_mutex_destroy(&executor->lock);
+    free(executor->workers);
+    free(executor);
+}
+
+// Parallel map over arrays with a loaded kernel. The work is cut into chunks, every worker owns a
+// contiguous run of them, so that the pages it first touches stay on its node, and takes them from the
+// front. Workers which run out steal from the back of the others' runs.
+enum map_kernel {
+    MAP_CHUNK,          // void f(const T *in, T *out, size_t n)
+    MAP_ELEMENT_INT,    // int f(int)
+    MAP_ELEMENT_LONG,   // long f(long)
+    MAP_ELEMENT_FLOAT,  // float f(float)
+    MAP_ELEMENT_DOUBLE, // double f(double)
+};
+
+// Element size of the element-wise kernels, the chunk kernel takes the caller's
+static const size_t map_element_sizes[] = {
+    [MAP_ELEMENT_INT] = sizeof(int),
+    [MAP_ELEMENT_LONG] = sizeof(long),
+    [MAP_ELEMENT_FLOAT] = sizeof(float),
+    [MAP_ELEMENT_DOUBLE] = sizeof(double),
+};
+
+// Bytes of input per chunk, enough to amortize the indirect calls and small enough to balance
+#define MAP_CHUNK_BYTES (64 * 1024)
+
+struct map_job {
+    enum map_kernel kernel;
+    void *fn;
+    const uint8_t *in;
+    uint8_t *out;
+    size_t n;
+    size_t elem_size;
+    size_t chunk_size;
+};
+
+// Chunks a worker has left as [front, back), packed into one word so that the owner taking the front
+// and thieves taking the back only need a CAS
+struct map_queue {
+    uint64_t range;
+} __attribute__((aligned(64)));
+
+struct map_pool {
+    // Workers including the calling thread, which is worker 0
+    int num_workers;
+    pthread_t *threads;
+    struct map_queue *queues;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    int num_running;
+    int stop;
+
+    struct map_job job;
+};
+
+struct map_worker {
+    struct map_pool *pool;
+    int id;
+};
+
+static int take_chunk(struct map_queue *queue, int front, uint32_t *chunk) {
+    uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);
+
+    for(;;) {
+        uint32_t lo = range, hi = range >> 32;
+        if(lo >= hi) {
+            return 0;
+        }
+
+        uint64_t next = front ? ((uint64_t)hi << 32) | (lo + 1) : ((uint64_t)(hi - 1) << 32) | lo;
+        if(__atomic_compare_exchange_n(&queue->range, &range, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = front ? lo : hi - 1;
+            return 1;
+        }
+    }
+}
+
+static void run_chunk(const struct map_job *job, uint32_t chunk) {
+    size_t start = (size_t)chunk * job->chunk_size;
+    size_t n = job->n - start < job->chunk_size ? job->n - start : job->chunk_size;
+    const void *in = job->in + start * job->elem_size;
+    void *out = job->out + start * job->elem_size;
+
+    switch(job->kernel) {
+        case MAP_CHUNK:
+            ((void (*)(const void *, void *, size_t))job->fn)(in, out, n);
+            break;
+        case MAP_ELEMENT_INT: {
+            int (*fn)(int) = job->fn;
+            for(size_t i = 0; i < n; i++) {
+                ((int *)out)[i] = fn(((const int *)in)[i]);
+            }
+            break;
+        }
+        case MAP_ELEMENT_LONG: {
+            long (*fn)(long) = job->fn;
+            for(size_t i = 0; i < n; i++) {
+                ((long *)out)[i] = fn(((const long *)in)[i]);
+            }
+            break;
+        }
+        case MAP_ELEMENT_FLOAT: {
+            float (*fn)(float) = job->fn;
+            for(size_t i = 0; i < n; i++) {
+                ((float *)out)[i] = fn(((const float *)in)[i]);
+            }
+            break;
+        }
+        case MAP_ELEMENT_DOUBLE: {
+            double (*fn)(double) = job->fn;
+            for(size_t i = 0; i < n; i++) {
+                ((double *)out)[i] = fn(((const double *)in)[i]);
+            }
+            break;
+        }
+    }
+}
+
+// Runs the chunks of worker id, then steals until no worker has any left
+static void run_map_worker(struct map_pool *pool, int id) {
+    uint32_t chunk;
+
+    while(take_chunk(&pool->queues[id], 1, &chunk)) {
+        run_chunk(&pool->job, chunk);
+    }
+
+    for(int i = 1; i < pool->num_workers; i++) {
+        struct map_queue *victim = &pool->queues[(id + i) % pool->num_workers];
+        while(take_chunk(victim, 0, &chunk)) {
+            run_chunk(&pool->job, chunk);
+        }
+    }
+}
+
+static void *map_worker_thread(void *arg) {
+    struct map_worker *worker = arg;
+    struct map_pool *pool = worker->pool;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->generation == generation && !pool->stop) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+
+        if(pool->stop) {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_map_worker(pool, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if(!--pool->num_running) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(worker);
+    return NULL;
+}
+
+// Starts num_workers - 1 threads, the thread calling parallel_map is worker 0. Each thread is pinned
+// to one of the CPUs the process may run on, so that its chunks stay near its node.
+static struct map_pool *create_map_pool(int num_workers) {
+    struct map_pool *pool = calloc(1, sizeof(struct map_pool));
+    if(!pool) {
+        perror("Failed to allocate map pool");
+        exit(errno);
+    }
+
+    pool->num_workers = num_workers < 1 ? 1 : num_workers;
+    pool->threads = calloc(pool->num_workers, sizeof(pthread_t));
+    pool->queues = aligned_alloc(64, pool->num_workers * sizeof(struct map_queue));
+    if(!pool->threads || !pool->queues) {
+        perror("Failed to allocate map pool");
+        exit(errno);
+    }
+    memset(pool->queues, 0, pool->num_workers * sizeof(struct map_queue));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    cpu_set_t allowed;
+    int num_allowed = 0;
+    if(!sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        num_allowed = CPU_COUNT(&allowed);
+    }
+
+    for(int i = 1; i < pool->num_workers; i++) {
+        struct map_worker *worker = malloc(sizeof(struct map_worker));
+        if(!worker) {
+            perror("Failed to allocate map worker");
+            exit(errno);
+        }
+        worker->pool = pool;
+        worker->id = i;
+
+        int err = pthread_create(&pool->threads[i], NULL, map_worker_thread, worker);
+        if(err) {
+            errno = err;
+            perror("Failed to start map worker");
+            exit(errno);
+        }
+
+        if(num_allowed > 1) {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            for(int c = 0, seen = 0; c < CPU_SETSIZE; c++) {
+                if(CPU_ISSET(c, &allowed) && seen++ == i % num_allowed) {
+                    CPU_SET(c, &cpu);
+                    break;
+                }
+            }
+            pthread_setaffinity_np(pool->threads[i], sizeof(cpu), &cpu);
+        }
+    }
+
+    return pool;
+}
+
+// Computes out[i] = fn(in[i]) for n elements. MAP_CHUNK needs the element size, the element-wise kernels
+// imply theirs and take 0 or that same size. Returns once every chunk is done. A pool runs one job at a
+// time, threads which map concurrently need a pool each.
+static void parallel_map(struct map_pool *pool, enum map_kernel kernel, void *fn, const void *in, void *out,
+                         size_t n, size_t elem_size) {
+    if(kernel != MAP_CHUNK) {
+        if(elem_size && elem_size != map_element_sizes[kernel]) {
+            fprintf(stderr, "Element size %zu does not match the kernel, which takes %zu bytes\n", elem_size, map_element_sizes[kernel]);
+            exit(EINVAL);
+        }
+        elem_size = map_element_sizes[kernel];
+    } else if(!elem_size) {
+        fprintf(stderr, "Chunk kernels need an element size\n");
+        exit(EINVAL);
+    }
+
+    if(!n) {
+        return;
+    }
+
+    struct map_job job = {
+        .kernel = kernel,
+        .fn = fn,
+        .in = in,
+        .out = out,
+        .n = n,
+        .elem_size = elem_size,
+        .chunk_size = MAP_CHUNK_BYTES / elem_size ? MAP_CHUNK_BYTES / elem_size : 1,
+    };
+    size_t num_chunks = (n + job.chunk_size - 1) / job.chunk_size;
+    if(num_chunks > UINT32_MAX) {
+        fprintf(stderr, "Too many elements for parallel_map\n");
+        exit(EINVAL);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    for(int i = 0; i < pool->num_workers; i++) {
+        uint64_t front = num_chunks * i / pool->num_workers;
+        uint64_t back = num_chunks * (i + 1) / pool->num_workers;
+        __atomic_store_n(&pool->queues[i].range, back << 32 | front, __ATOMIC_RELAXED);
+    }
+    pool->num_running = pool->num_workers - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_map_worker(pool, 0);
+
+    // Workers which woke up late find nothing left, but the job must outlive them
+    pthread_mutex_lock(&pool->lock);
+    while(pool->num_running) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void destroy_map_pool(struct map_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 1; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->queues);
+    free(pool);
+}
+
+static void print_compile_metrics(void) {
+    uint64_t num_requests = compile_metrics.num_requests;
+    uint64_t num_compiles = num_requests - compile_metrics.num_cache_hits;
+
+    printf("compile_obj: %llu requests, %llu cache hits\n", (unsigned long long)num_requests,
+           (unsigned long long)compile_metrics.num_cache_hits);
+    printf("  compile: avg %.3f ms, max %.3f ms\n", num_compiles ? compile_metrics.compile_ns / 1e6 / num_compiles : 0,
+           compile_metrics.max_compile_ns / 1e6);
+    printf("  load:    avg %.3f ms, max %.3f ms\n", num_requests ? compile_metrics.load_ns / 1e6 / num_requests : 0,
+           compile_metrics.max_load_ns / 1e6);
+}
+
+// Global symbol registry. Readers look names up without taking any locks: the table is never
+// modified once published, writers build a new one under registry_lock and swap the pointer.
+// Old tables are freed later, once no reader can still be using them, so writers never wait for readers.
+struct registry_entry {
+    uint64_t hash;
+    const char *name;
+    void *addr;
+    struct object *obj;
+};
+
+struct registry_table {
+    size_t capacity; // Power of two, at least twice the number of entries
+    size_t num_entries;
+    struct registry_entry entries[];
+};
+
+static struct registry_table *registry = NULL;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Objects in the registry in the order they were published, the newest definition of a name wins
+static struct object *first_published = NULL;
+static struct object *last_published = NULL;
+
+// Every reader thread owns a slot holding the registry epoch it entered the registry in, 0 when
+// it is outside of it. Slots are cache line sized so readers never share a line.
+#define MAX_REGISTRY_READERS 1024
+
+struct registry_reader {
+    uint64_t epoch;
+    int used;
+    // Nesting level of registry_enter, only touched by the owning thread
+    int depth;
+} __attribute__((aligned(64)));
+
+static struct registry_reader registry_readers[MAX_REGISTRY_READERS];
+static uint64_t registry_epoch = 1;
+
+static __thread struct registry_reader *thread_reader = NULL;
+static pthread_key_t thread_reader_key;
+static pthread_once_t thread_reader_once = PTHREAD_ONCE_INIT;
+
+static void release_registry_reader(void *reader) {
+    __atomic_store_n(&((struct registry_reader *)reader)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void create_registry_reader_key(void) {
+    pthread_key_create(&thread_reader_key, release_registry_reader);
+}
+
+static struct registry_reader *registry_reader(void) {
+    if(thread_reader) {
+        return thread_reader;
+    }
+
+    pthread_once(&thread_reader_once, create_registry_reader_key);
+
+    for(int i = 0; i < MAX_REGISTRY_READERS; i++) {
+        int unused = 0;
+        if(__atomic_compare_exchange_n(&registry_readers[i].used, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            thread_reader = &registry_readers[i];
+            pthread_setspecific(thread_reader_key, thread_reader);
+            return thread_reader;
+        }
+    }
+
+    fprintf(stderr, "More than %d threads reading the symbol registry\n", MAX_REGISTRY_READERS);
+    exit(EAGAIN);
+}
+
+// FNV-1a
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for(; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Addresses returned by registry_lookup stay mapped until the matching registry_exit, so a reader
+// has to hold the registry across both the lookup and the calls through the address. Unloading an
+// object waits for every reader that entered before it was retired. Calls nest.
+static void registry_enter(void) {
+    struct registry_reader *reader = registry_reader();
+    if(reader->depth++) {
+        return;
+    }
+
+    // The epoch has to be visible before the table is loaded, hence the sequentially consistent store
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&registry_epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+}
+
+static void registry_exit(void) {
+    if(!--thread_reader->depth) {
+        __atomic_store_n(&thread_reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void *registry_lookup(const char *name) {
+    uint64_t hash = hash_name(name);
+    void *addr = NULL;
+
+    registry_enter();
+
+    const struct registry_table *table = __atomic_load_n(&registry, __ATOMIC_SEQ_CST);
+    if(table) {
+        for(size_t i = hash & (table->capacity - 1); table->entries[i].name; i = (i + 1) & (table->capacity - 1)) {
+            if(table->entries[i].hash == hash && !strcmp(table->entries[i].name, name)) {
+                addr = table->entries[i].addr;
+                break;
+            }
+        }
+    }
+
+    registry_exit();
+
+    return addr;
+}
+
+static void registry_insert(struct registry_table *table, const struct registry_entry *entry) {
+    size_t i = entry->hash & (table->capacity - 1);
+    for(; table->entries[i].name; i = (i + 1) & (table->capacity - 1)) {
+        // A newer definition shadows the older one
+        if(table->entries[i].hash == entry->hash && !strcmp(table->entries[i].name, entry->name)) {
+            table->entries[i] = *entry;
+            return;
+        }
+    }
+
+    table->entries[i] = *entry;
+    table->num_entries++;
+}
+
+static struct registry_table *registry_alloc(size_t num_entries) {
+    size_t capacity = 16;
+    while(capacity < 2 * num_entries) {
+        capacity *= 2;
+    }
+
+    struct registry_table *table = calloc(1, sizeof(struct registry_table) + capacity * sizeof(struct registry_entry));
+    if(!table) {
+        perror("Failed to allocate symbol registry");
+        exit(errno);
+    }
+
+    table->capacity = capacity;
+    return table;
+}
+
+// Memory which readers may still be using, freed once every reader has moved past epoch
+struct registry_garbage {
+    uint64_t epoch;
+    void *ptr;
+    struct registry_garbage *next;
+};
+
+static struct registry_garbage *registry_garbage = NULL;
+
+// Frees what no reader can reach anymore. Called with registry_lock held.
+static void registry_collect(void) {
+    uint64_t min_epoch = UINT64_MAX;
+    for(int i = 0; i < MAX_REGISTRY_READERS; i++) {
+        uint64_t reader_epoch = __atomic_load_n(&registry_readers[i].epoch, __ATOMIC_ACQUIRE);
+        if(reader_epoch && reader_epoch < min_epoch) {
+            min_epoch = reader_epoch;
+        }
+    }
+
+    for(struct registry_garbage **garbage = &registry_garbage; *garbage;) {
+        if((*garbage)->epoch <= min_epoch) {
+            struct registry_garbage *next = (*garbage)->next;
+            free((*garbage)->ptr);
+            free(*garbage);
+            *garbage = next;
+        } else {
+            garbage = &(*garbage)->next;
+        }
+    }
+}
+
+// Makes new the current table and hands the old one, together with extra, over to the garbage list.
+// Returns the epoch of the new table. Called with registry_lock held.
+static uint64_t registry_swap(struct registry_table *new, void *extra) {
+    void *retired[] = { registry, extra };
+
+    __atomic_store_n(&registry, new, __ATOMIC_SEQ_CST);
+    uint64_t epoch = __atomic_add_fetch(&registry_epoch, 1, __ATOMIC_SEQ_CST);
+
+    for(int i = 0; i < 2; i++) {
+        if(!retired[i]) {
+            continue;
+        }
+
+        struct registry_garbage *garbage = malloc(sizeof(struct registry_garbage));
+        if(!garbage) {
+            perror("Failed to allocate symbol registry garbage");
+            exit(errno);
+        }
+
+        garbage->epoch = epoch;
+        garbage->ptr = retired[i];
+        garbage->next = registry_garbage;
+        registry_garbage = garbage;
+    }
+
+    registry_collect();
+
+    return epoch;
+}
+
+// Waits until every reader which entered the registry before epoch has left it
+static void registry_synchronize(uint64_t epoch) {
+    if(thread_reader && thread_reader->depth) {
+        fprintf(stderr, "Cannot unload an object from inside the symbol registry\n");
+        exit(EDEADLK);
+    }
+
+    for(int i = 0; i < MAX_REGISTRY_READERS; i++) {
+        for(;;) {
+            uint64_t reader_epoch = __atomic_load_n(&registry_readers[i].epoch, __ATOMIC_ACQUIRE);
+            if(!reader_epoch || reader_epoch >= epoch) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static int is_registry_symbol(struct object *obj, const Elf64_Sym *symbol) {
+    int bind = ELF64_ST_BIND(symbol->st_info);
+
+    int type = ELF64_ST_TYPE(symbol->st_info);
+
+    return (type == STT_FUNC || type == STT_GNU_IFUNC) && (bind == STB_GLOBAL || bind == STB_WEAK) &&
+           symbol->st_shndx < obj->num_sections && obj->section_runtime_bases[symbol->st_shndx];
+}
+
+// Adds all the global functions of a parsed object to the registry at once
+static void publish_object(struct object *obj) {
+    size_t num_entries = 0, names_size = 0;
+    for(int i = 0; i < obj->num_symbols; i++) {
+        if(is_registry_symbol(obj, &obj->symbols[i])) {
+            num_entries++;
+            names_size += strlen(obj->strtab + obj->symbols[i].st_name) + 1;
+        }
+    }
+
+    obj->registry_names = malloc(names_size);
+    obj->registry_entries = malloc((num_entries ? num_entries : 1) * sizeof(struct registry_entry));
+    if(!obj->registry_names || !obj->registry_entries) {
+        perror("Failed to allocate symbol names");
+        exit(errno);
+    }
+
+    pthread_mutex_lock(&registry_lock);
+
+    struct registry_table *table = registry_alloc((registry ? registry->num_entries : 0) + num_entries);
+    for(size_t i = 0; registry && i < registry->capacity; i++) {
+        if(registry->entries[i].name) {
+            registry_insert(table, &registry->entries[i]);
+        }
+    }
+
+    char *name = obj->registry_names;
+    for(int i = 0; i < obj->num_symbols; i++) {
+        if(!is_registry_symbol(obj, &obj->symbols[i])) {
+            continue;
+        }
+
+        strcpy(name, obj->strtab + obj->symbols[i].st_name);
+
+        struct registry_entry *entry = &obj->registry_entries[obj->num_registry_entries++];
+        entry->hash = hash_name(name);
+        entry->name = name;
+        entry->addr = symbol_runtime_address(obj, &obj->symbols[i]);
+        entry->obj = obj;
+        registry_insert(table, entry);
+
+        name += strlen(name) + 1;
+    }
+
+    obj->prev_published = last_published;
+    obj->next_published = NULL;
+    if(last_published) {
+        last_published->next_published = obj;
+    } else {
+        first_published = obj;
+    }
+    last_published = obj;
+
+    registry_swap(table, NULL);
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Removes all the functions of an object from the registry at once. Once this returns no new lookup
+// can observe them. The table is rebuilt from the objects still published, so that names the object
+// shadowed resolve to the older definitions again. Returns the epoch to pass to registry_synchronize
+// before the code goes away, 0 if the object was not published.
+static uint64_t retire_object(struct object *obj) {
+    pthread_mutex_lock(&registry_lock);
+
+    if(!obj->registry_entries) {
+        pthread_mutex_unlock(&registry_lock);
+        return 0;
+    }
+
+    if(obj->prev_published) {
+        obj->prev_published->next_published = obj->next_published;
+    } else {
+        first_published = obj->next_published;
+    }
+    if(obj->next_published) {
+        obj->next_published->prev_published = obj->prev_published;
+    } else {
+        last_published = obj->prev_published;
+    }
+
+    size_t num_entries = 0;
+    for(struct object *published = first_published; published; published = published->next_published) {
+        num_entries += published->num_registry_entries;
+    }
+
+    struct registry_table *table = registry_alloc(num_entries);
+    for(struct object *published = first_published; published; published = published->next_published) {
+        for(size_t i = 0; i < published->num_registry_entries; i++) {
+            registry_insert(table, &published->registry_entries[i]);
+        }
+    }
+
+    // Lookups still in flight may be comparing against the names
+    uint64_t epoch = registry_swap(table, obj->registry_names);
+    obj->registry_names = NULL;
+
+    // Readers only ever see the copies in the tables
+    free(obj->registry_entries);
+    obj->registry_entries = NULL;
+    obj->num_registry_entries = 0;
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return epoch;
+}
+
+// Unmaps the object, removes its functions from the symbol registry and frees everything the loader
+// allocated for it. Function pointers into the object must not be used afterwards.
+static void unload_obj(struct object *obj) {
+    if(obj->region) {
+        untrack_loaded_obj(obj);
+    }
+
+    // Readers may still be running code they looked up before the retirement
+    if(obj->registry_names) {
+        registry_synchronize(retire_object(obj));
+    }
+
+    // The optimized build uses the data of this one, so it goes first
+    if(obj->tiering) {
+        stop_tiering(obj->tiering);
+        if(obj->tiering->optimized) {
+            unload_obj(obj->tiering->optimized);
+        }
+
+        munmap(obj->tiering->stubs, obj->tiering->size);
+        add_process_syscalls(1);
+        free(obj->tiering->functions);
+        free(obj->tiering->source);
+        free(obj->tiering->flags);
+        free(obj->tiering);
+    }
+
+    release_obj_image(obj);
+
+    if(obj->region && !__atomic_sub_fetch(&obj->region->refs, 1, __ATOMIC_ACQ_REL)) {
+        retire_region_stats(obj->region);
+        munmap(obj->region->base, obj->region->size);
+        free(obj->region);
+    }
+
+    // Instances keep the shared code alive through their mappings
+    if(obj->shared_text) {
+        close(obj->shared_text->memfd);
+        free_layout(&obj->shared_text->layout, 1);
+        free(obj->shared_text);
+    }
+
+    if(obj->tls_module) {
+        unregister_tls_module(obj);
+    }
+
+    free(obj->tls_offsets);
+    free(obj->live_sections);
+    free(obj->shared_sections);
+    free(obj->section_runtime_bases);
+    free(obj->symbols_copy);
+    free(obj->deferred);
+    free((void *)obj->name);
+    free(obj);
+}
+
+static void execute_funcs(struct object *obj) {
+    int (*add5)(int);
+    int (*add10)(int);
+    const char *(*get_hello)(void);
+    int (*get_var)(void);
+    void (*set_var)(int num);
+    void (*say_hello)(void);
+
+    add5 = lookup_function(obj, "add5");
+    if(!add5) {
+        fprintf(stdout, "Failed to find function \"add5\"\n");
+        exit(ENOENT);
+    }
+    printf("add5(%d) = %d\n", 42, add5(42));
+
+    add10 = lookup_function(obj, "add10");
+    if(!add10) {
+        fprintf(stdout, "Failed to find function \"add10\"\n");
+        exit(ENOENT);
+    }
+    printf("add10(%d) = %d\n", 42, add10(42));
+
+    get_hello = lookup_function(obj, "get_hello");
+    if (!get_hello) {
+        fputs("Failed to find \"get_hello\" function\n", stderr);
+        exit(ENOENT);
+    }
+    printf("get_hello() = %s\n", get_hello());
+
+    say_hello = lookup_function(obj, "say_hello");
+    if (!say_hello) {
+        fputs("Failed to find \"say_hello\" function\n", stderr);
+        exit(ENOENT);
+    }
+
+    printf("say_hello()\n");
+    say_hello();
+
+    get_var = lookup_function(obj, "get_var");
+    if(!get_var) {
+        fprintf(stdout, "Failed to find function \"get_var\"\n");
+        exit(ENOENT);
+    }
+    printf("get_var() = %d\n", get_var());
+
+    set_var = lookup_function(obj, "set_var");
+    if(!set_var) {
+        fprintf(stdout, "Failed to find function \"set_var\"\n");
+        exit(ENOENT);
+    }
+    printf("set_var(42)\n");
+    set_var(42);
+    printf("get_var() = %d\n", get_var());
+}
+
+// Loads the variant of the kernels built for this CPU and checks the IFUNC dispatched code
+static void run_variants(void) {
+    struct object *obj = load_variant("bin/kernels.manifest");
+    parse_obj(obj);
+
+    const char *(*variant)(void) = lookup_function(obj, "variant");
+    void (*scale)(float *, float, int) = lookup_function(obj, "scale");
+    int (*sum)(const int *, int) = lookup_function(obj, "sum");
+    int (*call_sum)(const int *, int) = lookup_function(obj, "call_sum");
+    int (*sum_twice)(const int *, int) = lookup_function(obj, "sum_twice");
+
+    const char *clone = "unknown";
+    if(sum == lookup_function(obj, "sum.avx2")) {
+        clone = "sum.avx2";
+    } else if(sum == lookup_function(obj, "sum.default")) {
+        clone = "sum.default";
+    }
+
+    printf("Loaded %s, built for %s, sum resolved to %s\n", obj->name, variant(), clone);
+
+    float floats[1000];
+    int ints[1000];
+    for(int i = 0; i < 1000; i++) {
+        floats[i] = i;
+        ints[i] = i;
+    }
+
+    scale(floats, 0.5f, 1000);
+    printf("scale: %f, sum: %d, call_sum: %d, sum_twice: %d\n", floats[999], sum(ints, 1000), call_sum(ints, 1000), sum_twice(ints, 1000));
+
+    if(floats[999] != 499.5f || sum(ints, 1000) != 499500 || call_sum(ints, 1000) != 499500 || sum_twice(ints, 1000) != 999000) {
+        fprintf(stderr, "Kernels returned wrong results\n");
+        exit(EINVAL);
+    }
+
+    unload_obj(obj);
+
+    // Without -fpie a table of pointers to IFUNC symbols ends up in the read-only group
+    struct object *table = compile_obj(
+        "__attribute__((target_clones(\"avx2\", \"default\")))\n"
+        "int sum(const int *v, int n) {\n"
+        "    int total = 0;\n"
+        "    for(int i = 0; i < n; i++) {\n"
+        "        total += v[i];\n"
+        "    }\n"
+        "    return total;\n"
+        "}\n"
+        "int (*const sum_table[])(const int *, int) = { sum };\n"
+        "int call_table(const int *v, int n) {\n"
+        "    return sum_table[0](v, n);\n"
+        "}\n", "-O0 -fno-pie");
+    if(!table) {
+        exit(EINVAL);
+    }
+
+    int (*call_table)(const int *, int) = lookup_function(table, "call_table");
+    printf("call_table: %d\n", call_table(ints, 1000));
+    if(call_table(ints, 1000) != 499500) {
+        fprintf(stderr, "IFUNC table returned wrong results\n");
+        exit(EINVAL);
+    }
+
+    unload_obj(table);
+}
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Generates and compiles a function per constant, then does it again to hit the cache
+static void run_compile(int num_sources) {
+    char source[256];
+
+    for(int pass = 0; pass < 2; pass++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int i = 0; i < num_sources; i++) {
+            snprintf(source, sizeof(source), "int generated(int x) {\n    return x * %d + 1;\n}\n", i);
+
+            struct object *obj = compile_obj(source, "-O2");
+            if(!obj) {
+                exit(EINVAL);
+            }
+
+            int (*generated)(int) = lookup_function(obj, "generated");
+            if(generated(3) != 3 * i + 1) {
+                fprintf(stderr, "%s returned %d instead of %d\n", obj->name, generated(3), 3 * i + 1);
+                exit(EINVAL);
+            }
+
+            unload_obj(obj);
+        }
+
+        printf("pass %d: %d sources in %.1f ms\n", pass, num_sources, elapsed_ms(&start));
+    }
+
+    print_compile_metrics();
+}
+
+// Evicts the files from the page cache, so that the next load has to go to the storage
+static void drop_page_cache(const char **files, int num_files) {
+    for(int i = 0; i < num_files; i++) {
+        int fd = open(files[i], O_RDONLY);
+        if(fd < 0) {
+            perror("Failed to open object file.");
+            exit(errno);
+        }
+
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void count_finished_load(struct load_handle *handle, struct object *obj, void *arg) {
+    (void)handle;
+    (void)obj;
+    __atomic_fetch_add((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+// Queues loads on a background executor and keeps the calling thread busy until they finish, measuring
+// how long it ever goes without getting to run
+static void run_async(int num_loads, int max_concurrent) {
+    struct load_executor *executor = create_load_executor(max_concurrent);
+    struct load_handle **handles = calloc(num_loads, sizeof(struct load_handle *));
+    int num_finished = 0;
+
+    for(int i = 0; i < num_loads; i++) {
+        handles[i] = load_obj_async(executor, i % 2 ? "bin/obj_many.o" : "bin/obj.o");
+        on_load(handles[i], count_finished_load, &num_finished);
+    }
+
+    int num_cancelled = cancel_load(handles[num_loads - 1]);
+
+    // Bad files only fail their own loads
+    const char *bad_files[] = { "bin/missing.o", "Makefile" };
+    int bad_errors[] = { ENOENT, ENOEXEC };
+    for(int i = 0; i < 2; i++) {
+        struct load_handle *bad = load_obj_async(executor, bad_files[i]);
+        if(wait_load(bad) || poll_load(bad) != LOAD_FAILED || load_error(bad) != bad_errors[i]) {
+            fprintf(stderr, "Loading \"%s\" did not fail with %s\n", bad_files[i], strerror(bad_errors[i]));
+            exit(EINVAL);
+        }
+        free_load_handle(bad);
+    }
+
+    uint64_t num_ticks = 0, last = now_ns(), longest = 0;
+    while(__atomic_load_n(&num_finished, __ATOMIC_RELAXED) < num_loads) {
+        uint64_t now = now_ns();
+        if(now - last > longest) {
+            longest = now - last;
+        }
+        last = now;
+        num_ticks++;
+        sched_yield();
+    }
+
+    int num_loaded = 0;
+    for(int i = 0; i < num_loads; i++) {
+        struct object *obj = wait_load(handles[i]);
+        if(obj) {
+            num_loaded++;
+
+            int (*add5)(int) = lookup_function(obj, "add5");
+            if(i % 2 == 0 && add5(42) != 47) {
+                fprintf(stderr, "add5 of load %d returned %d\n", i, add5(42));
+                exit(EINVAL);
+            }
+
+            unload_obj(obj);
+        }
+        free_load_handle(handles[i]);
+    }
+
+    destroy_load_executor(executor);
+    free(handles);
+
+    printf("%d loads, %d cancelled, at most %d at once\n", num_loaded, num_cancelled, max_concurrent);
+    printf("calling thread ran %llu times while loading, longest stall %.3f ms\n", (unsigned long long)num_ticks,
+           longest / 1e6);
+}
+
+struct tls_thread {
+    struct object *obj;
+    unsigned long id;
+    unsigned long *total;
+    pthread_barrier_t *barrier;
+    int ok;
+};
+
+static void *tls_thread(void *arg) {
+    struct tls_thread *thread = arg;
+    unsigned long (*count)(unsigned long) = lookup_function(thread->obj, "count");
+    unsigned long (*get_calls)(void) = lookup_function(thread->obj, "get_calls");
+    unsigned long *(*total_addr)(void) = lookup_function(thread->obj, "total_addr");
+
+    unsigned long result = 0;
+    for(int i = 0; i < 100000; i++) {
+        result = count(thread->id);
+    }
+
+    thread->total = total_addr();
+    thread->ok = get_calls() == 100000 && *thread->total == 100000 * thread->id && result == 1000 + 100000 * thread->id;
+
+    // Blocks are freed when their thread exits, all of them have to be alive to compare addresses
+    pthread_barrier_wait(thread->barrier);
+    return NULL;
+}
+
+// Runs the thread local counters of each TLS model build on several threads at once, none of which
+// may see the others' counts
+static void run_tls(int num_threads) {
+    const char *files[] = { "bin/obj_tls_gd.o", "bin/obj_tls_ie.o", "bin/obj_tls_le.o" };
+    struct tls_thread *threads = calloc(num_threads, sizeof(struct tls_thread));
+    pthread_t *ids = calloc(num_threads, sizeof(pthread_t));
+
+    for(size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+        struct object *obj = load_obj(files[f]);
+        parse_obj(obj);
+
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, num_threads);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int t = 0; t < num_threads; t++) {
+            threads[t] = (struct tls_thread){ .obj = obj, .id = t + 1, .barrier = &barrier };
+            pthread_create(&ids[t], NULL, tls_thread, &threads[t]);
+        }
+
+        int num_ok = 0;
+        for(int t = 0; t < num_threads; t++) {
+            pthread_join(ids[t], NULL);
+            num_ok += threads[t].ok;
+            for(int u = 0; u < t; u++) {
+                num_ok -= threads[t].total == threads[u].total;
+            }
+        }
+
+        double ms = elapsed_ms(&start);
+        pthread_barrier_destroy(&barrier);
+
+        // This thread has not counted yet
+        unsigned long (*get_calls)(void) = lookup_function(obj, "get_calls");
+        if(num_ok != num_threads || get_calls()) {
+            fprintf(stderr, "%s: %d of %d threads had counters of their own\n", files[f], num_ok, num_threads);
+            exit(EINVAL);
+        }
+
+        printf("%s: %d threads with counters of their own, %.1f ms, %s TLS\n", files[f], num_threads, ms,
+               obj->num_static_tls_relocs ? "static" : "lazily allocated");
+
+        unload_obj(obj);
+    }
+
+    // Module ids and static TLS of unloaded objects are handed out again, zeroed
+    for(size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+        const int num_cycles = 2000;
+        for(int i = 0; i < num_cycles; i++) {
+            struct object *obj = load_obj(files[f]);
+            parse_obj(obj);
+
+            unsigned long (*count)(unsigned long) = lookup_function(obj, "count");
+            unsigned long (*get_calls)(void) = lookup_function(obj, "get_calls");
+            if(count(1) != 1001 || get_calls() != 1) {
+                fprintf(stderr, "%s: cycle %d started out with the counters of an unloaded copy\n", files[f], i);
+                exit(EINVAL);
+            }
+
+            unload_obj(obj);
+        }
+
+        printf("%s: %d load/unload cycles with %zu module ids, %zu bytes of static TLS in use\n", files[f],
+               num_cycles, num_tls_modules - 1, static_tls_used);
+    }
+
+    free(threads);
+    free(ids);
+}
+
+// Maps loaded kernels over large arrays, on one thread and on a pool
+static void run_map(int num_workers, size_t n) {
+    struct object *obj = load_obj("bin/obj.o");
+    struct object *kernels = load_variant("bin/kernels.manifest");
+    parse_obj(obj);
+    parse_obj(kernels);
+
+    void *add5 = lookup_function(obj, "add5");
+    void *square = lookup_function(kernels, "square");
+
+    int *ints_in = malloc(n * sizeof(int)), *ints_out = malloc(n * sizeof(int));
+    float *floats_in = malloc(n * sizeof(float)), *floats_out = malloc(n * sizeof(float));
+    if(!ints_in || !ints_out || !floats_in || !floats_out) {
+        perror("Failed to allocate map arrays");
+        exit(errno);
+    }
+
+    // Fault the outputs in up front, so that neither run pays for it
+    for(size_t i = 0; i < n; i++) {
+        ints_in[i] = i;
+        floats_in[i] = i % 1024;
+        ints_out[i] = 0;
+        floats_out[i] = 0;
+    }
+
+    int worker_counts[] = { 1, num_workers };
+    for(int w = 0; w < 2; w++) {
+        struct map_pool *pool = create_map_pool(worker_counts[w]);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        parallel_map(pool, MAP_ELEMENT_INT, add5, ints_in, ints_out, n, 0);
+        double add5_ms = elapsed_ms(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        parallel_map(pool, MAP_CHUNK, square, floats_in, floats_out, n, sizeof(float));
+        double square_ms = elapsed_ms(&start);
+
+        for(size_t i = 0; i < n; i++) {
+            if(ints_out[i] != (int)i + 5 || floats_out[i] != floats_in[i] * floats_in[i]) {
+                fprintf(stderr, "Wrong result at %zu\n", i);
+                exit(EINVAL);
+            }
+        }
+
+        printf("%d workers: add5 element-wise %.1f ms, square in chunks %.1f ms, %zu elements\n", worker_counts[w],
+               add5_ms, square_ms, n);
+
+        destroy_map_pool(pool);
+    }
+
+    free(ints_in);
+    free(ints_out);
+    free(floats_in);
+    free(floats_out);
+    unload_obj(kernels);
+    unload_obj(obj);
+}
+
+static void print_stats_row(const char *name, const struct load_stats *stats) {
+    uint64_t total_ns = 0;
+    for(int phase = 0; phase < NUM_LOAD_PHASES; phase++) {
+        total_ns += stats->phase_ns[phase];
+    }
+
+    printf("%-24s %8zu %8zu %8zu %6zu %6zu %5d %5llu %9.1f\n", name,
+           stats->section_bytes[SECTION_EXEC] + stats->section_bytes[SECTION_RODATA] + stats->section_bytes[SECTION_DATA],
+           stats->mapped_bytes[SECTION_EXEC] + stats->mapped_bytes[SECTION_RODATA] + stats->mapped_bytes[SECTION_DATA],
+           stats->padding_bytes[SECTION_EXEC] + stats->padding_bytes[SECTION_RODATA] + stats->padding_bytes[SECTION_DATA],
+           stats->num_trampolines, stats->num_jumptable_slots, stats->num_vmas, (unsigned long long)stats->num_syscalls,
+           total_ns / 1e3);
+}
+
+// Loads a few objects on their own and together, printing what each cost and the stats of the process
+static void run_stats(void) {
+    collect_phase_times = 1;
+
+    struct object *obj = load_obj("bin/obj.o");
+    parse_obj(obj);
+
+    struct object *tls = load_obj("bin/obj_tls_gd.o");
+    parse_obj(tls);
+
+    struct object *kernels = load_variant("bin/kernels.manifest");
+    parse_obj(kernels);
+
+    // Both share one region, each is charged its part of it
+    struct object *batch[] = { load_obj("bin/obj_sections.o"), load_obj("bin/obj_many.o") };
+    parse_objs(batch, 2, NULL);
+
+    printf("%-24s %8s %8s %8s %6s %6s %5s %5s %9s\n", "object", "sections", "mapped", "padding", "tramps", "slots",
+           "vmas", "calls", "us");
+
+    struct object *objs[] = { obj, tls, kernels, batch[0], batch[1] };
+    struct load_stats stats, objs_stats = { 0 };
+    for(size_t i = 0; i < sizeof(objs) / sizeof(objs[0]); i++) {
+        get_obj_stats(objs[i], &stats);
+        print_stats_row(objs[i]->name, &stats);
+
+        for(int class = SECTION_EXEC; class < NUM_SECTION_CLASSES; class++) {
+            objs_stats.mapped_bytes[class] += stats.mapped_bytes[class];
+            objs_stats.padding_bytes[class] += stats.padding_bytes[class];
+        }
+        objs_stats.num_vmas += stats.num_vmas;
+    }
+
+    get_process_stats(&stats);
+    print_stats_row("process", &stats);
+
+    size_t region_bytes = obj->region->size + tls->region->size + kernels->region->size + batch[0]->region->size;
+    if(stats.num_objects != 5 || stats.mapped_bytes[SECTION_EXEC] + stats.mapped_bytes[SECTION_RODATA] +
+                                 stats.mapped_bytes[SECTION_DATA] != region_bytes) {
+        fprintf(stderr, "Process stats do not add up over the loaded objects\n");
+        exit(EINVAL);
+    }
+
+    if(memcmp(objs_stats.mapped_bytes, stats.mapped_bytes, sizeof(stats.mapped_bytes)) ||
+       memcmp(objs_stats.padding_bytes, stats.padding_bytes, sizeof(stats.padding_bytes)) || objs_stats.num_vmas != stats.num_vmas) {
+        fprintf(stderr, "The objects' shares of their regions do not add up to the process stats\n");
+        exit(EINVAL);
+    }
+
+    dump_load_stats(stdout);
+
+    for(size_t i = 0; i < sizeof(objs) / sizeof(objs[0]); i++) {
+        unload_obj(objs[i]);
+    }
+
+    // The counts outlive the objects, the bytes do not
+    struct load_stats after;
+    get_process_stats(&after);
+    if(after.num_objects || after.mapped_bytes[SECTION_EXEC] || after.num_jumptable_slots != stats.num_jumptable_slots ||
+       after.relocs_by_type[R_X86_64_PLT32] != stats.relocs_by_type[R_X86_64_PLT32] || after.num_syscalls < stats.num_syscalls) {
+        fprintf(stderr, "Process stats did not survive unloading\n");
+        exit(EINVAL);
+    }
+    printf("After unloading: %zu jumptable slots, %llu syscalls, %zu bytes mapped\n", after.num_jumptable_slots,
+           (unsigned long long)after.num_syscalls, after.mapped_bytes[SECTION_EXEC]);
+}
+
+// Loads an object once whole and once from a few roots, comparing what both cost
+static void run_strip(const char *file, const char **roots, int num_roots) {
+    struct object *full = load_obj(file);
+    parse_obj(full);
+
+    struct object *obj = load_obj(file);
+    obj->roots = roots;
+    obj->num_roots = num_roots;
+    parse_obj(obj);
+
+    int num_live = 0, num_loaded = 0;
+    for(Elf64_Half i = 0; i < obj->num_sections; i++) {
+        num_live += !!obj->section_runtime_bases[i];
+        num_loaded += !!full->section_runtime_bases[i];
+    }
+
+    printf("%s: kept %d of %d sections, saved %zu bytes and %zu relocations, region %zu bytes instead of %zu\n",
+           file, num_live, num_loaded, obj->stripped_bytes, obj->stripped_relocs, obj->region->size, full->region->size);
+
+    for(int r = 0; r < num_roots; r++) {
+        if(!lookup_function(obj, roots[r])) {
+            fprintf(stderr, "Root %s was not loaded\n", roots[r]);
+            exit(ENOENT);
+        }
+    }
+
+    unload_obj(obj);
+    unload_obj(full);
+}
+
+// Calls a tiered function until it is promoted, comparing the time per call of both builds
+static void run_tiering(uint64_t threshold) {
+    const char *source =
+        "static long calls;\n"
+        "static long history[3];\n"
+        "static long *cursor = history;\n"
+        "long work(int n) {\n"
+        "    long sum = 0;\n"
+        "    for(int i = 0; i < n; i++) {\n"
+        "        sum += (long)i * i % 7;\n"
+        "    }\n"
+        "    calls++;\n"
+        "    *cursor++ = sum;\n"
+        "    if(cursor == history + 3) {\n"
+        "        cursor = history;\n"
+        "    }\n"
+        "    return sum;\n"
+        "}\n"
+        "long get_calls(void) {\n"
+        "    return calls;\n"
+        "}\n"
+        "long get_position(void) {\n"
+        "    return cursor - history;\n"
+        "}\n";
+
+    struct object *obj = compile_tiered(source, "", threshold);
+    if(!obj) {
+        exit(EINVAL);
+    }
+
+    long (*work)(int) = lookup_function(obj, "work");
+    long (*get_calls)(void) = lookup_function(obj, "get_calls");
+    long expected = work(1000);
+
+    double baseline_ns = 0, optimized_ns = 0;
+    long num_calls = 1;
+    struct timespec start;
+
+    for(int batch = 0; batch < 10000 && !optimized_ns; batch++) {
+        int promoted = __atomic_load_n(&obj->tiering->num_promoted, __ATOMIC_ACQUIRE);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < 100; i++) {
+            if(work(1000) != expected) {
+                fprintf(stderr, "work returned a different result\n");
+                exit(EINVAL);
+            }
+        }
+        double ns = elapsed_ms(&start) * 1e6 / 100;
+        num_calls += 100;
+
+        if(!batch) {
+            baseline_ns = ns;
+        } else if(promoted) {
+            optimized_ns = ns;
+        }
+    }
+
+    if(!optimized_ns) {
+        fprintf(stderr, "work was not promoted\n");
+        exit(EINVAL);
+    }
+
+    int stub = ((uint8_t *)work - obj->tiering->stubs) / TIER_STUB_SIZE;
+    printf("work: %.0f ns per call at -O0, %.0f ns per call at -O3 after %lu calls\n", baseline_ns, optimized_ns,
+           (unsigned long)obj->tiering->slots[stub].calls);
+
+    // Both builds count in the same variable
+    if(get_calls() != num_calls) {
+        fprintf(stderr, "get_calls() = %ld, expected %ld\n", get_calls(), num_calls);
+        exit(EINVAL);
+    }
+    printf("get_calls() = %ld, shared by both builds\n", get_calls());
+
+    // Loading the optimized build must not reset the pointer the baseline moved along
+    long (*get_position)(void) = lookup_function(obj, "get_position");
+    if(get_position() != num_calls % 3) {
+        fprintf(stderr, "get_position() = %ld, expected %ld\n", get_position(), num_calls % 3);
+        exit(EINVAL);
+    }
+
+    unload_obj(obj);
+    print_compile_metrics();
+}
+
+// Loads num_objects copies of bin/obj.o from a cold page cache with every I/O mode
+static void bench_io(int num_objects) {
+    const char *dir = "bin/bench-io";
+    const char *mode_names[] = { "mmap", "mmap+populate", "io_uring" };
+    const int num_runs = 3;
+
+    struct object *src = load_obj("bin/obj.o");
+
+    if(mkdir(dir, 0755) && errno != EEXIST) {
+        perror("Failed to create benchmark directory");
+        exit(errno);
+    }
+
+    const char **files = calloc(num_objects, sizeof(char *));
+    struct object **objs = calloc(num_objects, sizeof(struct object *));
+    if(!files || !objs) {
+        perror("Failed to allocate benchmark state");
+        exit(errno);
+    }
+
+    for(int i = 0; i < num_objects; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/obj_%d.o", dir, i);
+        files[i] = strdup(path);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || write(fd, src->base, src->size) != (ssize_t)src->size) {
+            perror("Failed to write benchmark object");
+            exit(errno);
+        }
+        close(fd);
+    }
+
+    // Modes take turns, so that none of them benefits from running on a fresher address space
+    double best_load[LOAD_IO_URING + 1], best_total[LOAD_IO_URING + 1];
+    enum load_io_mode used[LOAD_IO_URING + 1];
+    for(int run = 0; run < num_runs; run++) {
+        for(int mode = LOAD_IO_MMAP; mode <= LOAD_IO_URING; mode++) {
+            drop_page_cache(files, num_objects);
+
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            used[mode] = load_objs(files, num_objects, objs, mode);
+            double load = elapsed_ms(&start);
+
+            for(int i = 0; i < num_objects; i++) {
+                parse_obj(objs[i]);
+            }
+            double total = elapsed_ms(&start);
+
+            for(int i = 0; i < num_objects; i++) {
+                unload_obj(objs[i]);
+            }
+
+            if(!run || total < best_total[mode]) {
+                best_load[mode] = load;
+                best_total[mode] = total;
+            }
+        }
+    }
+
+    printf("Loading %d objects with a cold page cache, best of %d runs\n", num_objects, num_runs);
+    for(int mode = LOAD_IO_MMAP; mode <= LOAD_IO_URING; mode++) {
+        printf("%-14s read %8.3f ms, read + parse %8.3f ms, %6.2f us per object%s\n", mode_names[mode],
+               best_load[mode], best_total[mode], best_total[mode] * 1e3 / num_objects,
+               used[mode] != (enum load_io_mode)mode ? " (fell back to mmap+populate)" : "");
+    }
+}
+
+struct registry_bench {
+    int stop;
+    uint64_t num_lookups;
+    double ns_per_lookup;
+};
+
+// Keeps calling into whichever copy is published while the bench unloads the others
+static void *registry_bench_caller(void *arg) {
+    struct registry_bench *bench = arg;
+
+    while(!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        registry_enter();
+        int (*add10)(int) = registry_lookup("add10");
+        if(!add10 || add10(32) != 42) {
+            fprintf(stderr, "Published \"add10\" is broken\n");
+            exit(EINVAL);
+        }
+        registry_exit();
+        bench->num_lookups++;
+    }
+
+    return NULL;
+}
+
+static void *registry_bench_reader(void *arg) {
+    struct registry_bench *bench = arg;
+    const char *names[] = { "add5", "add10", "get_hello", "get_var", "set_var", "say_hello" };
+    uint64_t num_lookups = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    while(!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        for(int i = 0; i < 64; i++) {
+            if(!registry_lookup(names[i % 6])) {
+                fprintf(stderr, "Function \"%s\" is missing from the registry\n", names[i % 6]);
+                exit(ENOENT);
+            }
+        }
+        num_lookups += 64;
+    }
+
+    // CPU time rather than wall time, so the result does not depend on how many cores there are to share
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    bench->num_lookups = num_lookups;
+    bench->ns_per_lookup = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / num_lookups;
+
+    return NULL;
+}
+
+// Readers resolve functions while a writer keeps swapping two copies of bin/obj.o in and out
+static void bench_registry(int max_threads) {
+    struct object *objs[2];
+    for(int i = 0; i < 2; i++) {
+        objs[i] = load_obj("bin/obj.o");
+        parse_obj(objs[i]);
+    }
+
+    // Index of the copy which is published, the other one is not
+    int current = 0;
+    publish_object(objs[current]);
+
+    printf("%8s %14s %12s %10s\n", "readers", "lookups", "ns/lookup", "swaps");
+    for(int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        pthread_t threads[num_threads];
+        struct registry_bench benches[num_threads];
+        memset(benches, 0, sizeof(benches));
+
+        for(int i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, registry_bench_reader, &benches[i]);
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        uint64_t num_swaps = 0;
+        for(; elapsed_ms(&start) < 500; current ^= 1, num_swaps++) {
+            publish_object(objs[current ^ 1]);
+            retire_object(objs[current]);
+        }
+
+        for(int i = 0; i < num_threads; i++) {
+            __atomic_store_n(&benches[i].stop, 1, __ATOMIC_RELAXED);
+        }
+
+        uint64_t num_lookups = 0;
+        double ns_per_lookup = 0;
+        for(int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            num_lookups += benches[i].num_lookups;
+            ns_per_lookup += benches[i].ns_per_lookup / num_threads;
+        }
+
+        printf("%8d %14lu %12.1f %10lu\n", num_threads, num_lookups, ns_per_lookup, num_swaps);
+    }
+
+    unload_obj(objs[current ^ 1]);
+
+    // Replace the published copy by a fresh one and unload the old one while others call into it
+    int num_callers = max_threads < 4 ? max_threads : 4;
+    pthread_t threads[num_callers];
+    struct registry_bench benches[num_callers];
+    memset(benches, 0, sizeof(benches));
+
+    for(int i = 0; i < num_callers; i++) {
+        pthread_create(&threads[i], NULL, registry_bench_caller, &benches[i]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t num_unloads = 0;
+    for(; elapsed_ms(&start) < 500; num_unloads++) {
+        struct object *next = load_obj("bin/obj.o");
+        parse_obj(next);
+        publish_object(next);
+        unload_obj(objs[current]);
+        objs[current] = next;
+    }
+
+    uint64_t num_calls = 0;
+    for(int i = 0; i < num_callers; i++) {
+        __atomic_store_n(&benches[i].stop, 1, __ATOMIC_RELAXED);
+        pthread_join(threads[i], NULL);
+        num_calls += benches[i].num_lookups;
+    }
+
+    printf("%lu unloads under %lu calls from %d threads\n", num_unloads, num_calls, num_callers);
+
+    unload_obj(objs[current]);
+}
+
+// Runs many instances of bin/obj.o side by side, each with its own copy of var
+static void run_instances(int num_instances) {
+    struct object *tmpl = load_obj("bin/obj.o");
+    struct object **insts = calloc(num_instances, sizeof(struct object *));
+    if(!insts) {
+        perror("Failed to allocate instances");
+        exit(errno);
+    }
+
+    for(int i = 0; i < num_instances; i++) {
+        insts[i] = instantiate_obj(tmpl);
+
+        void (*set_var)(int) = lookup_function(insts[i], "set_var");
+        set_var(i * 10);
+    }
+
+    for(int i = 0; i < num_instances; i++) {
+        int (*get_var)(void) = lookup_function(insts[i], "get_var");
+        const char *(*get_hello)(void) = lookup_function(insts[i], "get_hello");
+        int (*add10)(int) = lookup_function(insts[i], "add10");
+
+        printf("instance %d at %p: get_var() = %d, add10(%d) = %d, get_hello() = %s\n", i,
+               (void *)insts[i]->region->base, get_var(), i, add10(i), get_hello());
+        if(get_var() != i * 10) {
+            fprintf(stderr, "Instance %d does not have its own data\n", i);
+            exit(EINVAL);
+        }
+    }
+
+    const struct runtime_region *region = insts[0]->region;
+    printf("%d instances: %zu bytes of code mapped once, %zu bytes of data per instance\n", num_instances,
+           region->class_size[SECTION_EXEC], region->class_size[SECTION_RODATA] + region->class_size[SECTION_DATA]);
+
+    for(int i = 0; i < num_instances; i++) {
+        unload_obj(insts[i]);
+    }
+    unload_obj(tmpl);
+    free(insts);
+}
+
+// Hardware counter for the calling thread, -1 when the event is not available (e.g. in most VMs)
+static int open_perf_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void print_perf_counter(const char *name, int fd, uint64_t num_calls) {
+    uint64_t value;
+
+    if(fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        printf("  %-22s n/a\n", name);
+        return;
+    }
+
+    printf("  %-22s %.4f per call\n", name, (double)value / num_calls);
+    close(fd);
+}
+
+// Calls the hot functions of several copies of bin/obj_many.o, first laid out in file order,
+// then laid out from a profile
+static void bench_layout(void) {
+    const char *file = "bin/obj_many.o";
+    const char *profile_file = "bin/obj_many.profile";
+    const int num_objs = 4, num_funcs = 1024, hot_stride = 16, num_rounds = 2000;
+    const int num_hot = num_objs * num_funcs / hot_stride;
+
+    // Every 16th function is hot
+    FILE *f = fopen(profile_file, "w");
+    if(!f) {
+        perror("Failed to write profile");
+        exit(errno);
+    }
+
+    char names[num_funcs / hot_stride][16];
+    for(int i = 0; i < num_funcs / hot_stride; i++) {
+        int n = i * hot_stride;
+        snprintf(names[i], sizeof(names[i]), "func_%d%d%d%d%d", n >> 8 & 3, n >> 6 & 3, n >> 4 & 3, n >> 2 & 3, n & 3);
+        fprintf(f, "%s %d\n", names[i], num_funcs - n);
+    }
+    fclose(f);
+
+    struct profile *profile = load_profile(profile_file);
+
+    for(int layout = 0; layout < 2; layout++) {
+        struct object *objs[num_objs];
+        for(int o = 0; o < num_objs; o++) {
+            objs[o] = load_obj(file);
+        }
+
+        parse_objs(objs, num_objs, layout ? profile : NULL);
+
+        int (*funcs[num_hot])(int);
+        for(int i = 0; i < num_hot; i++) {
+            funcs[i] = lookup_function(objs[i % num_objs], names[i / num_objs]);
+        }
+
+        // Call in a fixed random order, so the hardware prefetchers can't follow along
+        srand(42);
+        for(int i = num_hot - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            int (*tmp)(int) = funcs[i];
+            funcs[i] = funcs[j];
+            funcs[j] = tmp;
+        }
+
+        int num_pages = 0;
+        for(int i = 0; i < num_hot; i++) {
+            int seen = 0;
+            for(int j = 0; j < i && !seen; j++) {
+                seen = (uintptr_t)funcs[j] / page_size == (uintptr_t)funcs[i] / page_size;
+            }
+            num_pages += !seen;
+        }
+
+        int sum = 0;
+        for(int i = 0; i < num_hot; i++) {
+            sum += funcs[i](i);
+        }
+
+        int stalls = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND);
+        int itlb = open_perf_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        int icache = open_perf_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int round = 0; round < num_rounds; round++) {
+            for(int i = 0; i < num_hot; i++) {
+                sum += funcs[i](round);
+            }
+        }
+
+        double ms = elapsed_ms(&start);
+        uint64_t num_calls = (uint64_t)num_rounds * num_hot;
+
+        printf("%s layout: %d hot functions on %d pages, %.2f ns per call (checksum %d)\n",
+               layout ? "profile" : "file", num_hot, num_pages, ms * 1e6 / num_calls, sum);
+        print_perf_counter("frontend stall cycles", stalls, num_calls);
+        print_perf_counter("iTLB misses", itlb, num_calls);
+        print_perf_counter("L1i misses", icache, num_calls);
+
+        for(int o = 0; o < num_objs; o++) {
+            unload_obj(objs[o]);
+        }
+    }
+
+    free_profile(profile);
+}
+
+static size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if(!statm) {
+        perror("Failed to open /proc/self/statm");
+        exit(errno);
+    }
+
+    size_t size, resident;
+    if(fscanf(statm, "%zu %zu", &size, &resident) != 2) {
+        fprintf(stderr, "Failed to parse /proc/self/statm\n");
+        exit(EIO);
+    }
+
+    fclose(statm);
+    return resident * page_size;
+}
+
+// Keeps loading and unloading bin/obj.o through every load path and checks that neither the
+// resident memory nor the number of VMAs grows
+static void soak(int num_iterations) {
+    const char *file = "bin/obj.o";
+    const char *files[8] = { file, file, file, file, file, file, file, file };
+    const int num_warmup = 100;
+
+    int fd = open(file, O_RDONLY);
+    if(fd < 0) {
+        perror("Failed to open object file.");
+        exit(errno);
+    }
+
+    struct stat sb;
+    fstat(fd, &sb);
+    uint8_t *image = malloc(sb.st_size);
+    if(!image || read(fd, image, sb.st_size) != sb.st_size) {
+        perror("Failed to read object file");
+        exit(errno);
+    }
+    close(fd);
+
+    int memfd = memfd_create("obj.o", MFD_CLOEXEC);
+    if(memfd < 0 || write(memfd, image, sb.st_size) != sb.st_size) {
+        perror("Failed to create memfd");
+        exit(errno);
+    }
+
+    size_t warm_resident = 0;
+    int warm_vmas = 0;
+    for(int it = 0; it < num_warmup + num_iterations; it++) {
+        struct object *objs[8];
+        int num_objs = 1;
+
+        switch(it % 4) {
+            case 0:
+                objs[0] = load_obj(file);
+                break;
+            case 1:
+                objs[0] = load_obj_fd(memfd, "memfd");
+                break;
+            case 2:
+                objs[0] = load_obj_mem(image, sb.st_size, "buffer");
+                break;
+            case 3:
+                num_objs = 8;
+                load_objs(files, num_objs, objs, LOAD_IO_URING);
+                break;
+        }
+
+        for(int i = 0; i < num_objs; i++) {
+            parse_obj(objs[i]);
+            publish_object(objs[i]);
+        }
+
+        registry_enter();
+        int (*add10)(int) = registry_lookup("add10");
+        if(!add10 || add10(32) != 42) {
+            fprintf(stderr, "Loaded \"add10\" is broken\n");
+            exit(EINVAL);
+        }
+        registry_exit();
+
+        // Unloading the newest definition uncovers the one before it
+        for(int i = num_objs - 1; i >= 0; i--) {
+            unload_obj(objs[i]);
+            if(i && registry_lookup("add10") != lookup_function(objs[i - 1], "add10")) {
+                fprintf(stderr, "\"add10\" does not resolve to the older definition after unloading\n");
+                exit(EINVAL);
+            }
+        }
+
+        if(registry_lookup("add10")) {
+            fprintf(stderr, "\"add10\" is still registered after unloading\n");
+            exit(EINVAL);
+        }
+
+        if(it == num_warmup - 1) {
+            warm_resident = resident_bytes();
+            warm_vmas = count_vmas(NULL, SIZE_MAX);
+        }
+    }
+
+    size_t resident = resident_bytes();
+    int vmas = count_vmas(NULL, SIZE_MAX);
+    printf("%d load/unload cycles: RSS %zu -> %zu KiB, VMAs %d -> %d\n", num_iterations,
+           warm_resident / 1024, resident / 1024, warm_vmas, vmas);
+
+    close(memfd);
+    free(image);
+
+    // Allow for some malloc noise, a leak shows up as growth proportional to the number of cycles
+    if(vmas > warm_vmas || resident > warm_resident + 64 * page_size) {
+        fprintf(stderr, "Memory is not reclaimed on unload\n");
+        exit(ENOMEM);
+    }
+}
+
+int main(int argc, char **argv) {
+    page_size = sysconf(_SC_PAGESIZE);
+
+    const char *trace_path = getenv("LOADER_TRACE");
+    if(trace_path) {
+        trace_file = strcmp(trace_path, "-") ? fopen(trace_path, "a") : stderr;
+        if(!trace_file) {
+            perror("Failed to open trace file");
+            fprintf(stderr, "File \"%s\"\n", trace_path);
+            exit(errno);
+        }
+    }
+
+    const char *stats_path = getenv("LOADER_STATS");
+    if(stats_path) {
+        stats_file = strcmp(stats_path, "-") ? fopen(stats_path, "a") : stderr;
+        if(!stats_file) {
+            perror("Failed to open stats file");
+            fprintf(stderr, "File \"%s\"\n", stats_path);
+            exit(errno);
+        }
+        collect_phase_times = 1;
+        atexit(dump_stats_at_exit);
+    }
+
+    if(getenv("CC")) {
+        compiler = getenv("CC");
+    }
+    if(getenv("LOADER_CACHE_DIR")) {
+        compile_cache_dir = getenv("LOADER_CACHE_DIR");
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "bench-io")) {
+        bench_io(argc > 2 ? atoi(argv[2]) : 500);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "soak")) {
+        soak(argc > 2 ? atoi(argv[2]) : 10000);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "instances")) {
+        run_instances(argc > 2 ? atoi(argv[2]) : 4);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "bench-layout")) {
+        bench_layout();
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "stats")) {
+        run_stats();
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "strip")) {
+        const char *roots[] = { "add10" };
+        run_strip("bin/obj_sections.o", roots, 1);
+
+        struct object *obj = load_obj("bin/obj_sections.o");
+        obj->roots = roots;
+        obj->num_roots = 1;
+        parse_obj(obj);
+        int (*add10)(int) = lookup_function(obj, "add10");
+        printf("add10(42) = %d, get_hello %s\n", add10(42), lookup_function(obj, "get_hello") ? "loaded" : "left out");
+        unload_obj(obj);
+
+        const char *many_roots[] = { "func_00000", "func_33333" };
+        run_strip("bin/obj_many.o", many_roots, 2);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "map")) {
+        run_map(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? strtoull(argv[3], NULL, 0) : 1 << 24);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "tls")) {
+        run_tls(argc > 2 ? atoi(argv[2]) : 4);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "async")) {
+        run_async(argc > 2 ? atoi(argv[2]) : 16, argc > 3 ? atoi(argv[3]) : 2);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "tiering")) {
+        run_tiering(argc > 2 ? atoi(argv[2]) : 1000);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "compile")) {
+        run_compile(argc > 2 ? atoi(argv[2]) : 20);
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "variants")) {
+        run_variants();
+        return 0;
+    }
+
+    if(argc > 1 && !strcmp(argv[1], "bench-registry")) {
+        bench_registry(argc > 2 ? atoi(argv[2]) : 64);
+        return 0;
+    }
+
+    struct object *obj = load_obj("bin/obj.o");
+    parse_obj(obj);
+    printf("Loaded %zu bytes with %d syscalls into %d VMAs\n", obj->region->size, obj->region->num_syscalls,
+           count_vmas(obj->region->base, obj->region->size));
+    execute_funcs(obj);
+    unload_obj(obj);
+    return 0;
+}